@@ -0,0 +1,118 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <vector>
+
+/* MemTable使用的bump-pointer内存池
+ * 小对象从当前块中顺序切分，大对象单独分配一个块
+ * reset时保留标准大小的块以供复用，只释放大块，不需要逐个节点delete
+ * allocate可以被多个写线程并发调用，临界区只有几次指针运算，用自旋锁保护
+ */
+class Arena
+{
+private:
+    static const size_t BLOCKSIZE = 4096;
+    static const size_t ALIGN = alignof(void *);
+
+    char *allocPtr = nullptr;        // 当前块中下一个可用位置
+    size_t remaining = 0;            // 当前块剩余字节数
+    std::vector<char *> blocks;      // 正在使用的标准块
+    std::vector<char *> freeBlocks;  // reset后留待复用的标准块
+    std::vector<char *> largeBlocks; // 大对象单独分配的块
+    std::atomic<size_t> usage{0};    // 已分配出去的字节数
+    std::atomic_flag spin = ATOMIC_FLAG_INIT;
+
+    char *newBlock()
+    {
+        char *block;
+        if (!freeBlocks.empty())
+        {
+            block = freeBlocks.back();
+            freeBlocks.pop_back();
+        }
+        else
+        {
+            block = static_cast<char *>(std::malloc(BLOCKSIZE));
+        }
+        blocks.push_back(block);
+        return block;
+    }
+
+    char *allocateLocked(size_t bytes)
+    {
+        size_t mod = reinterpret_cast<uintptr_t>(allocPtr) & (ALIGN - 1);
+        size_t slop = mod == 0 ? 0 : ALIGN - mod;
+        size_t needed = bytes + slop;
+        usage.fetch_add(bytes, std::memory_order_relaxed);
+        if (needed <= remaining)
+        {
+            char *result = allocPtr + slop;
+            allocPtr += needed;
+            remaining -= needed;
+            return result;
+        }
+        // malloc返回的内存已经满足对齐要求
+        return allocateFallback(bytes);
+    }
+
+    char *allocateFallback(size_t bytes)
+    {
+        if (bytes > BLOCKSIZE / 4)
+        {
+            // 大对象单独分配，避免浪费当前块的剩余空间
+            char *block = static_cast<char *>(std::malloc(bytes));
+            largeBlocks.push_back(block);
+            return block;
+        }
+        allocPtr = newBlock();
+        remaining = BLOCKSIZE;
+        char *result = allocPtr;
+        allocPtr += bytes;
+        remaining -= bytes;
+        return result;
+    }
+
+public:
+    Arena() {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena()
+    {
+        for (char *b : blocks)
+            std::free(b);
+        for (char *b : freeBlocks)
+            std::free(b);
+        for (char *b : largeBlocks)
+            std::free(b);
+    }
+
+    // 分配按指针大小对齐的内存
+    char *allocate(size_t bytes)
+    {
+        while (spin.test_and_set(std::memory_order_acquire))
+            ;
+        char *result = allocateLocked(bytes);
+        spin.clear(std::memory_order_release);
+        return result;
+    }
+
+    // 丢弃所有已分配的对象，调用者需保证此时没有其他线程在使用arena
+    void reset()
+    {
+        for (char *b : largeBlocks)
+            std::free(b);
+        largeBlocks.clear();
+        freeBlocks.insert(freeBlocks.end(), blocks.begin(), blocks.end());
+        blocks.clear();
+        allocPtr = nullptr;
+        remaining = 0;
+        usage = 0;
+    }
+
+    size_t memoryUsage() const
+    {
+        return usage;
+    }
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include "ShardedLRUCache.h"
+
+/* SSTable数据block的缓存，所有SSTable共享，以(SSTable的编号, block序号)为键
+ * 缓存的是解析后的block，通过shared_ptr返回，被淘汰之后正在使用的读者仍然可以访问
+ */
+template <typename Block>
+class BlockCache : public ShardedLRUCache<std::shared_ptr<const Block>>
+{
+private:
+    typedef ShardedLRUCache<std::shared_ptr<const Block>> Base;
+
+    static uint64_t makeKey(uint64_t tableId, uint32_t blockIdx)
+    {
+        return (tableId << 32) | blockIdx;
+    }
+
+public:
+    BlockCache(size_t capacity) : Base(capacity) {}
+
+    std::shared_ptr<const Block> lookup(uint64_t tableId, uint32_t blockIdx)
+    {
+        std::shared_ptr<const Block> block;
+        Base::lookup(makeKey(tableId, blockIdx), block);
+        return block;
+    }
+
+    void insert(uint64_t tableId, uint32_t blockIdx, const std::shared_ptr<const Block> &block, size_t charge)
+    {
+        Base::insert(makeKey(tableId, blockIdx), block, charge);
+    }
+};
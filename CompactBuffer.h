@@ -1,25 +1,90 @@
 #pragma once
 #include <cstdint>
 #include <string>
-#include <fstream>
+#include <memory>
 #include <vector>
+#include <queue>
+#include <algorithm>
 #include "ssTable.h"
 
 #define MAXSIZE (16 * 1024)
-#define NODESIZE 20
 
-// 存放一个SSTable的数据和时间戳
+/* 一个要被合并的SSTable，按顺序逐个读取block，内存中只保留当前的block
+ * pos是归并时下一个要读取的项在当前block中的位置 */
 struct DataTable
 {
+    const SSTable *table;
+    std::shared_ptr<const SSTable::Index> index;
     uint64_t timeStamp;
-    std::vector<SSTable::KOVPari> data;
-    DataTable(std::vector<SSTable::KOVPari> nodes, uint64_t time) : data(nodes), timeStamp(time) {}
+    size_t blockIdx = 0;
+    std::shared_ptr<const SSTable::Block> block;
+    size_t pos = 0;
+    DataTable(const SSTable *t, std::shared_ptr<const SSTable::Index> &&_index)
+        : table(t), index(std::move(_index)), timeStamp(t->getTime()) {}
+
+    /* 读取从blockIdx开始的第一个非空block，没有更多数据时返回false
+     * 读取失败时抛出std::runtime_error，不能跳过，否则合并会丢掉这部分数据 */
+    bool loadBlock()
+    {
+        for (; blockIdx < index->blocks.size(); blockIdx++)
+        {
+            // 合并时每个block只读一次，不放入缓存
+            block = table->readBlock(*index, blockIdx, false);
+            pos = 0;
+            if (block->size() > 0)
+            {
+                return true;
+            }
+        }
+        block.reset();
+        return false;
+    }
+
+    uint64_t key() const
+    {
+        return block->keys[pos];
+    }
+
+    // 当前项，inline的value的offset是在block->values中的位置
+    SSTable::KOVPari entry() const
+    {
+        return SSTable::KOVPari(block->keys[pos], block->offsets[pos], block->vlens[pos]);
+    }
+
+    // 移动到下一项，没有更多数据时返回false
+    bool next()
+    {
+        if (++pos < block->size())
+        {
+            return true;
+        }
+        blockIdx++;
+        return loadBlock();
+    }
 };
 
 class CompactBuffer
 {
-    std::vector<DataTable> dataTables;      // 所有要被合并的SSTable
-    std::vector<SSTable::KOVPari> tmpNodes; // 完成归并排序后的所有KOVPair
+    std::vector<DataTable> dataTables;       // 所有要被合并的SSTable
+    std::vector<SSTable::KOVPari> discarded; // 被更新版本覆盖而丢弃的KOVPair，对应的vLog数据已经失效
+
+    // 归并堆中的一项，指向某个table当前的第一项
+    struct Cursor
+    {
+        uint64_t key;
+        uint64_t time;
+        size_t table;
+        // 堆顶是key最小的，key相同时时间戳大的在前，再相同时先读入的table在前
+        bool operator<(const Cursor &c) const
+        {
+            if (key != c.key)
+                return key > c.key;
+            if (time != c.time)
+                return time < c.time;
+            return table > c.table;
+        }
+    };
+
 public:
     uint64_t timeStamp; // 合并后的新时间
     CompactBuffer()
@@ -28,150 +93,107 @@ public:
     }
     ~CompactBuffer() {}
 
-    // 将需要的合并的一个SSTable读入
-    void read(std::fstream *in)
+    /* 加入一个需要合并的SSTable，只读取index和第一个block，其余的block在归并时按需读取
+     * 合并结束之前t必须一直有效 */
+    void read(const SSTable *t)
     {
-        uint64_t time;
-        in->read((char *)&time, sizeof(time));
-        uint64_t num = 0;
-        in->read((char *)&num, sizeof(num));
-
-        // 定位到数据区的起始位置
-        in->seekg(SSTable::BASE, std::ios::beg);
-        std::vector<SSTable::KOVPari> Index;
-        uint64_t key;
-        uint64_t offset;
-        uint32_t vlen;
-        for (uint64_t i = 0; i < num; i++)
+        DataTable table(t, t->getIndex());
+        if (table.loadBlock())
         {
-            in->read((char *)&key, sizeof(key));
-            in->read((char *)&offset, sizeof(offset));
-            in->read((char *)&vlen, sizeof(vlen));
-            Index.emplace_back(key, offset, vlen);
+            dataTables.push_back(std::move(table));
         }
-        // Index里面装满了一个SSTable的所有KOVPair
-        dataTables.emplace_back(Index, time);
     }
 
-    // isempty为true代表下一层为空，否则为false
-    void compact(bool isempty)
+    /* 用最小堆对所有table做多路归并，相同的key只保留时间戳最大的版本
+     * isempty为true代表下一层为空，此时删除标记也可以丢弃
+     * 每凑满一个SSTable就调用emit(kovPairs, values)输出，inline的value在values中
+     * 输出的大小按policy生成的过滤器以及index和footer一起计算，不超过MAXSIZE(至少一项) */
+    template <typename Emit>
+    void compact(bool isempty, const FilterPolicy &policy, const Emit &emit)
     {
-        tmpNodes.clear();
-        int location = 0;
-
-        uint64_t min = UINT64_MAX, max = 0;
-        // 一轮排序中的最大时间戳
-        uint64_t maxTime = 0;
-
+        discarded.clear();
         this->timeStamp = 0;
-        // 选取最大的时间戳
+        std::priority_queue<Cursor> heap;
         for (size_t i = 0; i < dataTables.size(); i++)
         {
-            if (dataTables[i].timeStamp > this->timeStamp)
-            {
-                this->timeStamp = dataTables[i].timeStamp;
-            }
+            // 选取最大的时间戳
+            this->timeStamp = std::max(this->timeStamp, dataTables[i].timeStamp);
+            heap.push(Cursor{dataTables[i].key(), dataTables[i].timeStamp, i});
         }
-        // 如果待合并的Tables不是空的，就删除所有的重复键值，选择其中最大时间戳的键值作为真正的键值
-        while (dataTables.empty() == false)
+
+        std::vector<SSTable::KOVPari> out;
+        std::string outValues;
+        // 按encodeTable的规则切分block：数据区的总长度、block的数量和最后一个block的长度
+        size_t dataSize = 0;
+        size_t blockNum = 0;
+        size_t blockSize = 0;
+        bool hasLast = false;
+        uint64_t lastKey = 0;
+        while (!heap.empty())
         {
-            size_t ss_num = dataTables.size();
-            min = UINT64_MAX;
-            maxTime = 0;
-            location = 0;
-            for (size_t i = 0; i < ss_num; i++)
+            Cursor c = heap.top();
+            heap.pop();
+            DataTable &table = dataTables[c.table];
+            SSTable::KOVPari node = table.entry();
+            // 读取下一个block之后，node的inline value仍在这个block中
+            std::shared_ptr<const SSTable::Block> block = table.block;
+            if (table.next())
             {
-                SSTable::KOVPari data = dataTables[i].data.front();
-                if (data.key < min)
-                {
-                    maxTime = dataTables[i].timeStamp;
-                    location = i;
-                    min = data.key;
-                }
-                else if (data.key == min)
-                {
-                    if (dataTables[i].timeStamp > maxTime)
-                    {
-                        dataTables[location].data.erase(dataTables[location].data.begin());
-                        maxTime = dataTables[i].timeStamp;
-                        location = i;
-                    }
-                    else
-                    {
-                        dataTables[i].data.erase(dataTables[i].data.begin());
-                    }
-                }
+                heap.push(Cursor{table.key(), table.timeStamp, c.table});
             }
 
-            // 现在拿到了最小的键
-            SSTable::KOVPari node = dataTables[location].data.front();
-            // 如果 不是 一个被删除的node且下一层为空，则将数据存在tmpNodes中
-            if (!(isempty && node.vlen == 0))
+            // 同一个key最先出堆的是最新的版本，之后的都丢弃
+            if (hasLast && node.key == lastKey)
             {
-                tmpNodes.push_back(node);
+                discarded.push_back(node);
+                continue;
             }
-            dataTables[location].data.erase(dataTables[location].data.begin());
-            ss_num = dataTables.size();
-            // 如果有已经读完的table，就删除
-            for (int i = 0; i < ss_num; i++)
+            hasLast = true;
+            lastKey = node.key;
+            // 如果是一个被删除的node且下一层为空，就不需要保存
+            if (isempty && node.vlen == 0)
             {
-                if (dataTables[i].data.empty())
-                {
-                    dataTables.erase(dataTables.begin() + i);
-                    i--;
-                    ss_num--;
-                }
+                continue;
             }
-        }
-    }
 
-    // 以SSTable格式输出
-    void write(std::fstream *out)
-    {
-        if (this->tmpNodes.empty())
-        {
-            return;
-        }
-        std::vector<bool> bf;
-        std::vector<SSTable::KOVPari> dataSet = getData(bf);
-        out->write((char *)&this->timeStamp, sizeof(timeStamp));
-        size_t Size = dataSet.size();
-        out->write((char *)&Size, sizeof(Size));
-        uint64_t Min = dataSet.front().key;
-        uint64_t Max = dataSet.back().key;
-        out->write((char *)&Min, sizeof(Min));
-        out->write((char *)&Max, sizeof(Max));
-        // 写入过滤器
-        for (size_t i = 0; i < BFSIZE; i += 8)
-        {
-            char b = 0;
-            for (size_t j = 0; j < 8; j++)
+            size_t len = SSTable::entrySize(node);
+            bool newBlock = blockNum == 0 || blockSize + len > SSTable::BLOCKSIZE;
+            size_t size = SSTable::encodedSize(dataSize + len, blockNum + newBlock, out.size() + 1, policy);
+            // 至少放入一项，避免过大的inline value导致死循环
+            if (size > MAXSIZE && !out.empty())
+            {
+                emit(out, outValues);
+                out.clear();
+                outValues.clear();
+                dataSize = 0;
+                blockNum = 0;
+                newBlock = true;
+            }
+            if (SSTable::isInline(node.vlen))
             {
-                if (bf[i + j])
-                {
-                    b = (1 << (7 - j)) | b;
-                }
+                // inline的value搬到outValues中
+                uint64_t pos = outValues.size();
+                outValues.append(block->values, node.offset, SSTable::valueLen(node.vlen));
+                node.offset = pos;
             }
-            out->write(&b, sizeof(b));
+            out.push_back(node);
+            dataSize += len;
+            blockNum += newBlock;
+            blockSize = newBlock ? len : blockSize + len;
         }
-        for (SSTable::KOVPari kovP : dataSet)
+        if (!out.empty())
         {
-            out->write((char *)&kovP.key, sizeof(kovP.key));
-            out->write((char *)&kovP.offset, sizeof(kovP.offset));
-            out->write((char *)&kovP.vlen, sizeof(kovP.vlen));
+            emit(out, outValues);
         }
+        dataTables.clear();
     }
 
     uint64_t maxKey()
     {
         uint64_t max = 0;
-        size_t size = dataTables.size();
-        for (size_t i = 0; i < size; i++)
+        for (const DataTable &t : dataTables)
         {
-            if (max < dataTables[i].data.back().key)
-            {
-                max = dataTables[i].data.back().key;
-            }
+            max = std::max(max, t.table->maxK());
         }
         return max;
     }
@@ -179,69 +201,24 @@ public:
     uint64_t minKey()
     {
         uint64_t min = UINT64_MAX;
-        size_t size = dataTables.size();
-        for (size_t i = 0; i < size; i++)
+        for (const DataTable &t : dataTables)
         {
-            if (min > dataTables[i].data.front().key)
-            {
-                min = dataTables[i].data.front().key;
-            }
+            min = std::min(min, t.table->minK());
         }
         return min;
     }
 
-    // 从nodes中获取SSTable不超过16kB的数据，
-    std::vector<SSTable::KOVPari> getData(std::vector<bool> &BF)
-    {
-        BF.resize(BFSIZE, 0);
-        std::vector<SSTable::KOVPari> data;
-        size_t init_size = SSTable::BASE;
-        while (1)
-        {
-            if (this->tmpNodes.empty())
-                break;
-            init_size += NODESIZE;
-            if (init_size > MAXSIZE)
-                break;
-            data.push_back(this->tmpNodes.front());
-            this->tmpNodes.erase(this->tmpNodes.begin());
-            uint32_t hash[4] = {0};
-            MurmurHash3_x64_128(&data.back().key, sizeof(data.back().key), 1, hash);
-            for (int i = 0; i < 4; i++)
-            {
-                BF[hash[i] % BFSIZE] = 1;
-            }
-        }
-        return data;
-    }
-
     // 清空数据，用于实现初始化
     void clear()
     {
         dataTables.clear();
-        tmpNodes.clear();
+        discarded.clear();
         timeStamp = 0;
     }
 
-    bool isEmpty(){
-        return this->tmpNodes.empty();
-    }
-
-     std::vector<SSTable::KOVPari> getData_Tmp()
+    // 本次合并中丢弃的旧版本
+    const std::vector<SSTable::KOVPari> &getDiscarded() const
     {
-        std::vector<SSTable::KOVPari> data;
-        size_t init_size = SSTable::BASE;
-        std::vector<SSTable::KOVPari> tmp = tmpNodes;
-        while (1)
-        {
-            if (tmp.empty())
-                break;
-            init_size += NODESIZE;
-            if (init_size > MAXSIZE)
-                break;
-            data.push_back(tmp.front());
-            tmp.erase(tmp.begin());
-        }
-        return data;
+        return discarded;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ShardedLRUCache.h"
+
+// 一个打开的只读文件，最后一个使用者释放时关闭
+struct FileHandle
+{
+    const int fd;
+    explicit FileHandle(int _fd) : fd(_fd) {}
+    ~FileHandle()
+    {
+        close(fd);
+    }
+};
+
+/* SSTable文件描述符的缓存，所有SSTable共享，以SSTable的编号为键，最多同时打开capacity个文件
+ * 通过shared_ptr返回，被淘汰之后正在读取的线程用完才关闭
+ */
+class FileCache : public ShardedLRUCache<std::shared_ptr<const FileHandle>>
+{
+private:
+    typedef ShardedLRUCache<std::shared_ptr<const FileHandle>> Base;
+
+public:
+    FileCache(size_t capacity) : Base(capacity) {}
+
+    // 打开失败返回nullptr，errno为失败的原因
+    static std::shared_ptr<const FileHandle> openFile(const std::string &fileName)
+    {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        return fd < 0 ? nullptr : std::make_shared<const FileHandle>(fd);
+    }
+
+    /* 取得tableId对应的文件，不在缓存中时打开fileName并放入缓存
+     * 文件描述符用完时先关闭缓存中的文件再重试一次 */
+    std::shared_ptr<const FileHandle> get(uint64_t tableId, const std::string &fileName)
+    {
+        std::shared_ptr<const FileHandle> file;
+        if (Base::lookup(tableId, file))
+        {
+            return file;
+        }
+        file = openFile(fileName);
+        if (!file && (errno == EMFILE || errno == ENFILE))
+        {
+            clear();
+            file = openFile(fileName);
+        }
+        if (file)
+        {
+            Base::insert(tableId, file, 1);
+        }
+        return file;
+    }
+};
@@ -0,0 +1,435 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "MurmurHash3.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* 旧格式SSTable中固定的Bloom Filter，大小为8kB = 8*1024bytes 65536bits */
+#define BFSIZE 65536
+
+/* SSTable的过滤器类型，记录在文件的footer中 */
+enum class FilterType : uint32_t
+{
+    BLOOM = 0,         // 旧格式固定大小的Bloom Filter，只用于读取旧文件
+    BLOCKED_BLOOM = 1, // 按每个key的bit数确定大小，一个key的所有bit在同一个cache line中
+    XOR8 = 2,          // 静态的Xor Filter，同样的误判率下比Bloom Filter更小
+};
+
+/* 生成新SSTable时使用的过滤器，bitsPerKey只对BLOCKED_BLOOM有效 */
+struct FilterPolicy
+{
+    FilterType type = FilterType::BLOCKED_BLOOM;
+    uint32_t bitsPerKey = 10;
+};
+
+/* 判断一个key是否可能在SSTable中，返回false时key一定不存在 */
+class Filter
+{
+public:
+    virtual ~Filter() {}
+    virtual bool mayContain(uint64_t key) const = 0;
+    virtual FilterType type() const = 0;
+
+    // 按policy为keys生成过滤器，编码追加到out末尾
+    static void build(const FilterPolicy &policy, const std::vector<uint64_t> &keys, std::string &out);
+    // 按policy为keyNum个不同的key生成的过滤器编码后的长度(不超过)
+    static size_t encodedSize(const FilterPolicy &policy, size_t keyNum);
+    // 从文件中的编码恢复过滤器，数据不合法时返回nullptr
+    static std::unique_ptr<Filter> decode(FilterType type, const char *data, size_t size);
+};
+
+/* 旧格式的Bloom Filter：65536bit，每个key通过MurmurHash3设置4个bit
+ * 按文件中的格式保存，第i个bit是第i/8个字节的第7-i%8位 */
+class LegacyBloomFilter : public Filter
+{
+private:
+    std::string bits;
+
+public:
+    LegacyBloomFilter(const char *data) : bits(data, BFSIZE / 8) {}
+
+    bool mayContain(uint64_t key) const override
+    {
+        uint32_t hash[4] = {0};
+        MurmurHash3_x64_128(&key, sizeof(key), 1, hash);
+        for (int i = 0; i < 4; i++)
+        {
+            uint32_t bit = hash[i] % BFSIZE;
+            if (!(bits[bit / 8] & (1 << (7 - bit % 8))))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    FilterType type() const override
+    {
+        return FilterType::BLOOM;
+    }
+};
+
+/* 分块的Bloom Filter，由若干64字节的line组成，line的数量由key的数量和每个key的bit数决定
+ * 一个key先选出一个line，再在line的8个64位word中各设置1个bit，查询只访问一个cache line
+ * 文件中按顺序保存所有line，长度就是line数量*64字节 */
+class BlockedBloomFilter : public Filter
+{
+public:
+    struct alignas(64) Line
+    {
+        uint64_t words[8];
+    };
+
+private:
+    std::vector<Line> lines;
+
+    static constexpr uint32_t SALT[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                          0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+    static uint64_t hash(uint64_t key)
+    {
+        return fmix64(key + 0x9E3779B97F4A7C15ULL);
+    }
+
+    // 按每个key的bit数需要的line数量
+    static size_t lineCount(size_t keyNum, uint32_t bitsPerKey)
+    {
+        return std::max<size_t>(1, (keyNum * bitsPerKey + 511) / 512);
+    }
+
+    // 高32位选择line
+    size_t lineIndex(uint64_t h) const
+    {
+        return ((h >> 32) * lines.size()) >> 32;
+    }
+
+    // 低32位分别乘以8个salt，取高6位作为每个word中的bit
+    static void makeMask(uint32_t h, uint64_t mask[8])
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            mask[i] = 1ULL << ((h * SALT[i]) >> 26);
+        }
+    }
+
+    static bool probe(const Line &line, uint32_t h)
+    {
+        uint64_t mask[8];
+        makeMask(h, mask);
+        uint64_t miss = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            miss |= mask[i] & ~line.words[i];
+        }
+        return miss == 0;
+    }
+
+#if defined(__x86_64__)
+    // 用AVX2一次计算8个bit的位置并检查整个line
+    __attribute__((target("avx2"))) static bool probeAVX2(const Line &line, uint32_t h)
+    {
+        const __m256i salt = _mm256_setr_epi32(SALT[0], SALT[1], SALT[2], SALT[3], SALT[4], SALT[5], SALT[6], SALT[7]);
+        __m256i pos = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h), salt), 26);
+        const __m256i ones = _mm256_set1_epi64x(1);
+        __m256i m0 = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pos)));
+        __m256i m1 = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pos, 1)));
+        __m256i w0 = _mm256_load_si256((const __m256i *)line.words);
+        __m256i w1 = _mm256_load_si256((const __m256i *)(line.words + 4));
+        // mask中有而line中没有的bit
+        __m256i miss = _mm256_or_si256(_mm256_andnot_si256(w0, m0), _mm256_andnot_si256(w1, m1));
+        return _mm256_testz_si256(miss, miss);
+    }
+#endif
+
+public:
+    // 为keyNum个key分配空间，至少一个line
+    BlockedBloomFilter(size_t keyNum, uint32_t bitsPerKey)
+        : lines(lineCount(keyNum, bitsPerKey))
+    {
+        std::memset(lines.data(), 0, lines.size() * sizeof(Line));
+    }
+
+    BlockedBloomFilter(const char *data, size_t size) : lines(size / sizeof(Line))
+    {
+        std::memcpy(lines.data(), data, lines.size() * sizeof(Line));
+    }
+
+    void add(uint64_t key)
+    {
+        uint64_t h = hash(key);
+        Line &line = lines[lineIndex(h)];
+        uint64_t mask[8];
+        makeMask((uint32_t)h, mask);
+        for (int i = 0; i < 8; i++)
+        {
+            line.words[i] |= mask[i];
+        }
+    }
+
+    bool mayContain(uint64_t key) const override
+    {
+        uint64_t h = hash(key);
+        const Line &line = lines[lineIndex(h)];
+#if defined(__x86_64__)
+        static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+        if (hasAVX2)
+        {
+            return probeAVX2(line, (uint32_t)h);
+        }
+#endif
+        return probe(line, (uint32_t)h);
+    }
+
+    FilterType type() const override
+    {
+        return FilterType::BLOCKED_BLOOM;
+    }
+
+    void encode(std::string &out) const
+    {
+        out.append((const char *)lines.data(), lines.size() * sizeof(Line));
+    }
+
+    // 为keyNum个key生成的过滤器编码后的长度
+    static size_t encodedSize(size_t keyNum, uint32_t bitsPerKey)
+    {
+        return lineCount(keyNum, bitsPerKey) * sizeof(Line);
+    }
+
+    // 编码的长度必须是line的整数倍
+    static bool validSize(size_t size)
+    {
+        return size > 0 && size % sizeof(Line) == 0;
+    }
+};
+
+/* Xor Filter(Graf & Lemire)：每个key对应三个分段中各一个8位的fingerprint，
+ * 三个fingerprint的异或等于key的fingerprint时认为key可能存在
+ * 每个key约占9.84bit，误判率约0.4%，生成之后不能再插入，适合很少重写的SSTable
+ * 文件中的格式：seed(8) | 分段长度(4) | 3*分段长度个fingerprint */
+class XorFilter : public Filter
+{
+private:
+    uint64_t seed;
+    uint32_t blockLength;
+    std::vector<uint8_t> fingerprints;
+
+    // 生成失败时换一个seed重试的次数
+    const static int MAXATTEMPTS = 64;
+    const static size_t HEADERSIZE = 12;
+
+    static uint64_t hash(uint64_t key, uint64_t seed)
+    {
+        return fmix64(key + seed);
+    }
+
+    static uint8_t fingerprint(uint64_t h)
+    {
+        return (uint8_t)(h ^ (h >> 32));
+    }
+
+    static uint64_t rotl(uint64_t x, int r)
+    {
+        return (x << r) | (x >> ((64 - r) & 63));
+    }
+
+    // 第i个分段中的位置
+    size_t slot(uint64_t h, int i) const
+    {
+        uint32_t r = (uint32_t)rotl(h, 21 * i);
+        return (size_t)i * blockLength + (((uint64_t)r * blockLength) >> 32);
+    }
+
+    // 对排好序的keys逐个剥离只被一个key使用的位置，成功时按相反的顺序写入fingerprint
+    bool construct(const std::vector<uint64_t> &keys)
+    {
+        size_t capacity = 3 * (size_t)blockLength;
+        std::vector<uint64_t> xorMask(capacity, 0);
+        std::vector<uint32_t> count(capacity, 0);
+        for (size_t k = 0; k < keys.size(); k++)
+        {
+            if (k > 0 && keys[k] == keys[k - 1])
+            {
+                continue;
+            }
+            uint64_t h = hash(keys[k], seed);
+            for (int i = 0; i < 3; i++)
+            {
+                size_t s = slot(h, i);
+                xorMask[s] ^= h;
+                count[s]++;
+            }
+        }
+        std::vector<size_t> queue;
+        for (size_t s = 0; s < capacity; s++)
+        {
+            if (count[s] == 1)
+            {
+                queue.push_back(s);
+            }
+        }
+        // 剥离的顺序：(key的hash, 分配给它的位置)
+        std::vector<std::pair<uint64_t, size_t>> stack;
+        while (!queue.empty())
+        {
+            size_t s = queue.back();
+            queue.pop_back();
+            if (count[s] != 1)
+            {
+                continue;
+            }
+            uint64_t h = xorMask[s];
+            stack.emplace_back(h, s);
+            for (int i = 0; i < 3; i++)
+            {
+                size_t t = slot(h, i);
+                xorMask[t] ^= h;
+                if (--count[t] == 1)
+                {
+                    queue.push_back(t);
+                }
+            }
+        }
+        for (size_t s = 0; s < capacity; s++)
+        {
+            if (count[s] != 0)
+            {
+                return false; // 有环，需要换seed
+            }
+        }
+        fingerprints.assign(capacity, 0);
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+        {
+            uint64_t h = it->first;
+            fingerprints[it->second] = fingerprint(h) ^ fingerprints[slot(h, 0)] ^
+                                       fingerprints[slot(h, 1)] ^ fingerprints[slot(h, 2)];
+        }
+        return true;
+    }
+
+public:
+    // keys按升序排列，相同的key只计一次
+    XorFilter(const std::vector<uint64_t> &keys) : seed(0x9E3779B97F4A7C15ULL), blockLength(lengthFor(keys.size()))
+    {
+        for (int i = 0; !construct(keys); i++)
+        {
+            if (i == MAXATTEMPTS)
+            {
+                blockLength = 0; // 不做过滤
+                break;
+            }
+            seed = fmix64(seed + i + 1);
+        }
+    }
+
+    XorFilter(const char *data, size_t size)
+    {
+        std::memcpy(&seed, data, 8);
+        std::memcpy(&blockLength, data + 8, 4);
+        fingerprints.assign(data + HEADERSIZE, data + size);
+    }
+
+    // keyNum个key时每个分段的长度
+    static uint32_t lengthFor(size_t keyNum)
+    {
+        size_t capacity = 32 + (size_t)(1.23 * keyNum);
+        return capacity / 3 + 1;
+    }
+
+    // 为keyNum个不同的key生成的过滤器编码后的长度，生成失败时更短
+    static size_t encodedSize(size_t keyNum)
+    {
+        return HEADERSIZE + 3 * (size_t)lengthFor(keyNum);
+    }
+
+    // 编码的长度要和记录的分段长度一致，分段长度为0表示生成失败，不做过滤
+    static bool validSize(const char *data, size_t size)
+    {
+        uint32_t len;
+        if (size < HEADERSIZE)
+        {
+            return false;
+        }
+        std::memcpy(&len, data + 8, 4);
+        return size == HEADERSIZE + 3 * (size_t)len;
+    }
+
+    bool mayContain(uint64_t key) const override
+    {
+        // 生成失败时不做过滤
+        if (fingerprints.empty())
+        {
+            return true;
+        }
+        uint64_t h = hash(key, seed);
+        return fingerprint(h) == (fingerprints[slot(h, 0)] ^ fingerprints[slot(h, 1)] ^ fingerprints[slot(h, 2)]);
+    }
+
+    FilterType type() const override
+    {
+        return FilterType::XOR8;
+    }
+
+    void encode(std::string &out) const
+    {
+        out.append((const char *)&seed, 8);
+        out.append((const char *)&blockLength, 4);
+        out.append((const char *)fingerprints.data(), fingerprints.size());
+    }
+};
+
+inline void Filter::build(const FilterPolicy &policy, const std::vector<uint64_t> &keys, std::string &out)
+{
+    if (policy.type == FilterType::XOR8)
+    {
+        XorFilter(keys).encode(out);
+        return;
+    }
+    BlockedBloomFilter bf(keys.size(), policy.bitsPerKey);
+    for (uint64_t key : keys)
+    {
+        bf.add(key);
+    }
+    bf.encode(out);
+}
+
+inline size_t Filter::encodedSize(const FilterPolicy &policy, size_t keyNum)
+{
+    if (policy.type == FilterType::XOR8)
+    {
+        return XorFilter::encodedSize(keyNum);
+    }
+    return BlockedBloomFilter::encodedSize(keyNum, policy.bitsPerKey);
+}
+
+inline std::unique_ptr<Filter> Filter::decode(FilterType type, const char *data, size_t size)
+{
+    switch (type)
+    {
+    case FilterType::BLOOM:
+        if (size == BFSIZE / 8)
+        {
+            return std::unique_ptr<Filter>(new LegacyBloomFilter(data));
+        }
+        break;
+    case FilterType::BLOCKED_BLOOM:
+        if (BlockedBloomFilter::validSize(size))
+        {
+            return std::unique_ptr<Filter>(new BlockedBloomFilter(data, size));
+        }
+        break;
+    case FilterType::XOR8:
+        if (XorFilter::validSize(data, size))
+        {
+            return std::unique_ptr<Filter>(new XorFilter(data, size));
+        }
+        break;
+    }
+    return nullptr;
+}
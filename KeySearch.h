@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/* 在升序排列的key数组中查找，返回第一个 >= key 的位置，没有则返回n
+ * 循环中只有一次比较，编译为条件传送，不会因为分支预测失败而停顿
+ */
+static inline size_t branchlessLowerBound(const uint64_t *keys, size_t n, uint64_t key)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    const uint64_t *base = keys;
+    while (n > 1)
+    {
+        size_t half = n / 2;
+        base = (base[half - 1] < key) ? base + half : base;
+        n -= half;
+    }
+    return (base - keys) + (*base < key);
+}
+
+/* Eytzinger顺序(BFS顺序的完全二叉树)存放的key，下标从1开始，节点k的子节点是2k和2k+1
+ * 查找时访问的节点集中在数组前部，并且可以提前预取之后几层的节点，适合很大的数组
+ * rank记录每个节点在原来升序数组中的位置
+ */
+class EytzingerIndex
+{
+private:
+    std::vector<uint64_t> tree;
+    std::vector<uint32_t> rank;
+
+    // 中序遍历的顺序就是升序
+    size_t build(const uint64_t *keys, size_t i, size_t k)
+    {
+        if (k < tree.size())
+        {
+            i = build(keys, i, 2 * k);
+            tree[k] = keys[i];
+            rank[k] = i++;
+            i = build(keys, i, 2 * k + 1);
+        }
+        return i;
+    }
+
+public:
+    EytzingerIndex() {}
+    EytzingerIndex(const uint64_t *keys, size_t n) : tree(n + 1), rank(n + 1)
+    {
+        build(keys, 0, 1);
+    }
+
+    size_t size() const
+    {
+        return tree.size() - 1;
+    }
+
+    // 返回值与branchlessLowerBound相同
+    size_t lowerBound(uint64_t key) const
+    {
+        const uint64_t *t = tree.data();
+        size_t n = tree.size();
+        size_t k = 1;
+        while (k < n)
+        {
+            // 预取4层之后的16个节点，它们在同一个cache line附近
+            __builtin_prefetch(t + 16 * k);
+            k = 2 * k + (t[k] < key);
+        }
+        // 去掉最后一段向右走的路径，剩下的就是第一个 >= key 的节点
+        k >>= __builtin_ffsll(~k);
+        return k == 0 ? size() : rank[k];
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/* LZ77系列的快速压缩，格式与LZ4的block格式类似
+ * 由若干sequence组成：token(1) | 字面量长度扩展 | 字面量 | 匹配距离(2) | 匹配长度扩展
+ * token高4位是字面量长度，低4位是匹配长度减MINMATCH，等于15时后面跟若干字节继续累加，直到某个字节小于255
+ * 最后一个sequence只有字面量，没有匹配部分
+ */
+class LZCodec
+{
+private:
+    const static int MINMATCH = 4;
+    const static int HASHBITS = 12;
+    const static uint32_t MAXDISTANCE = 65535;
+    // 末尾的若干字节总是作为字面量，保证匹配时读取4字节不会越界
+    const static size_t LASTLITERALS = 5;
+
+    static uint32_t read32(const char *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t hash(uint32_t v)
+    {
+        return (v * 2654435761u) >> (32 - HASHBITS);
+    }
+
+    static void writeLength(std::string &out, size_t len)
+    {
+        while (len >= 255)
+        {
+            out.push_back((char)255);
+            len -= 255;
+        }
+        out.push_back((char)len);
+    }
+
+    // 读取扩展的长度，数据不完整返回false
+    static bool readLength(const unsigned char *&ip, const unsigned char *end, size_t &len)
+    {
+        unsigned char b;
+        do
+        {
+            if (ip >= end)
+            {
+                return false;
+            }
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+
+    static void writeSequence(std::string &out, const char *literal, size_t litLen, uint32_t distance, size_t matchLen)
+    {
+        size_t m = matchLen ? matchLen - MINMATCH : 0;
+        unsigned char token = (unsigned char)((litLen >= 15 ? 15 : litLen) << 4);
+        if (matchLen)
+        {
+            token |= m >= 15 ? 15 : m;
+        }
+        out.push_back((char)token);
+        if (litLen >= 15)
+        {
+            writeLength(out, litLen - 15);
+        }
+        out.append(literal, litLen);
+        if (matchLen)
+        {
+            uint16_t d = distance;
+            out.append((const char *)&d, sizeof(d));
+            if (m >= 15)
+            {
+                writeLength(out, m - 15);
+            }
+        }
+    }
+
+public:
+    // 压缩src中的len字节，结果追加到out末尾
+    static void compress(const char *src, size_t len, std::string &out)
+    {
+        uint32_t table[1 << HASHBITS] = {0};
+        size_t anchor = 0;
+        size_t pos = 0;
+        size_t limit = len > LASTLITERALS + MINMATCH ? len - LASTLITERALS - MINMATCH : 0;
+        // table中存的是位置加1，0表示空
+        while (pos < limit)
+        {
+            uint32_t v = read32(src + pos);
+            uint32_t h = hash(v);
+            uint32_t cand = table[h];
+            table[h] = pos + 1;
+            if (cand == 0 || pos - (cand - 1) > MAXDISTANCE || read32(src + cand - 1) != v)
+            {
+                pos++;
+                continue;
+            }
+            size_t ref = cand - 1;
+            // 向前扩展匹配
+            while (pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1])
+            {
+                pos--;
+                ref--;
+            }
+            size_t matchLen = MINMATCH;
+            while (pos + matchLen < len - LASTLITERALS && src[pos + matchLen] == src[ref + matchLen])
+            {
+                matchLen++;
+            }
+            writeSequence(out, src + anchor, pos - anchor, pos - ref, matchLen);
+            pos += matchLen;
+            anchor = pos;
+            // 匹配内部的位置也放进表中，提高之后命中的概率
+            if (pos - 2 < limit)
+            {
+                table[hash(read32(src + pos - 2))] = pos - 1;
+            }
+        }
+        writeSequence(out, src + anchor, len - anchor, 0, 0);
+    }
+
+    // 解压到dst，输出长度必须恰好是rawLen，数据损坏时返回false
+    static bool decompress(const char *src, size_t len, char *dst, size_t rawLen)
+    {
+        const unsigned char *ip = (const unsigned char *)src;
+        const unsigned char *end = ip + len;
+        size_t op = 0;
+        while (ip < end)
+        {
+            unsigned char token = *ip++;
+            size_t litLen = token >> 4;
+            if (litLen == 15 && !readLength(ip, end, litLen))
+            {
+                return false;
+            }
+            if ((size_t)(end - ip) < litLen || rawLen - op < litLen)
+            {
+                return false;
+            }
+            std::memcpy(dst + op, ip, litLen);
+            ip += litLen;
+            op += litLen;
+            if (ip == end)
+            {
+                break; // 最后一个sequence
+            }
+            if (end - ip < 2)
+            {
+                return false;
+            }
+            uint16_t distance;
+            std::memcpy(&distance, ip, sizeof(distance));
+            ip += 2;
+            size_t matchLen = token & 15;
+            if (matchLen == 15 && !readLength(ip, end, matchLen))
+            {
+                return false;
+            }
+            matchLen += MINMATCH;
+            if (distance == 0 || distance > op || rawLen - op < matchLen)
+            {
+                return false;
+            }
+            const char *ref = dst + op - distance;
+            if (distance >= matchLen)
+            {
+                std::memcpy(dst + op, ref, matchLen);
+            }
+            else
+            {
+                // 重叠的匹配只能逐字节复制
+                for (size_t i = 0; i < matchLen; i++)
+                {
+                    dst[op + i] = ref[i];
+                }
+            }
+            op += matchLen;
+        }
+        return op == rawLen;
+    }
+};
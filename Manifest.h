@@ -0,0 +1,356 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <utility>
+#include "utils.h"
+
+/* 一个SSTable的元数据，fileName是在所在层目录中的文件名 */
+struct TableMeta
+{
+    int level;
+    std::string fileName;
+    uint64_t minK;
+    uint64_t maxK;
+    uint64_t time;
+    uint64_t kvNum;
+    uint64_t fileSize;
+};
+
+/* 一次版本变更：删除和添加若干SSTable，在MANIFEST中作为一条record原子地生效
+ * 每一项：类型(1) 层号(4) 文件名长度(4) 文件名，ADD之后还有 minK(8) maxK(8) 时间戳(8) 键值对数量(8) 文件大小(8)
+ * PENDING表示落盘或合并将要写出这个文件，之后没有ADD它就是崩溃时留下的无用文件
+ * 回放时按顺序应用，同一条record中先删除再添加同名的文件也是允许的
+ */
+class VersionEdit
+{
+public:
+    enum Type : uint8_t
+    {
+        ADD = 1,
+        REMOVE = 2,
+        PENDING = 3
+    };
+
+private:
+    std::string rep;
+
+    void appendHead(Type type, int level, const std::string &fileName)
+    {
+        uint32_t l = level;
+        uint32_t len = fileName.size();
+        rep.push_back((char)type);
+        rep.append((const char *)&l, sizeof(l));
+        rep.append((const char *)&len, sizeof(len));
+        rep.append(fileName);
+    }
+
+public:
+    void addTable(const TableMeta &m)
+    {
+        appendHead(ADD, m.level, m.fileName);
+        rep.append((const char *)&m.minK, 8);
+        rep.append((const char *)&m.maxK, 8);
+        rep.append((const char *)&m.time, 8);
+        rep.append((const char *)&m.kvNum, 8);
+        rep.append((const char *)&m.fileSize, 8);
+    }
+
+    void removeTable(int level, const std::string &fileName)
+    {
+        appendHead(REMOVE, level, fileName);
+    }
+
+    void pendingTable(int level, const std::string &fileName)
+    {
+        appendHead(PENDING, level, fileName);
+    }
+
+    bool empty() const
+    {
+        return rep.empty();
+    }
+
+    const std::string &data() const
+    {
+        return rep;
+    }
+
+    /* 把编码后的edit应用到levels上，levels[l]按添加的顺序排列
+     * garbage记录可能还留在磁盘上但不属于任何版本的文件(层号, 文件名)：被删除的，以及PENDING之后没有添加的
+     * 数据不完整返回false，此时levels和garbage可能只应用了一部分 */
+    static bool apply(const char *data, size_t size, std::vector<std::vector<TableMeta>> &levels,
+                      std::set<std::pair<int, std::string>> &garbage)
+    {
+        size_t pos = 0;
+        while (pos < size)
+        {
+            if (pos + 9 > size)
+            {
+                return false;
+            }
+            Type type = (Type)data[pos];
+            uint32_t level, len;
+            std::memcpy(&level, data + pos + 1, 4);
+            std::memcpy(&len, data + pos + 5, 4);
+            pos += 9;
+            if (pos + len > size)
+            {
+                return false;
+            }
+            std::string fileName(data + pos, len);
+            pos += len;
+            if (level >= levels.size())
+            {
+                levels.resize(level + 1);
+            }
+            std::vector<TableMeta> &l = levels[level];
+            std::pair<int, std::string> file((int)level, fileName);
+            if (type == REMOVE || type == PENDING)
+            {
+                garbage.insert(file);
+            }
+            else if (type == ADD)
+            {
+                garbage.erase(file);
+            }
+            if (type == REMOVE)
+            {
+                for (auto it = l.begin(); it != l.end(); ++it)
+                {
+                    if (it->fileName == fileName)
+                    {
+                        l.erase(it);
+                        break;
+                    }
+                }
+            }
+            else if (type == ADD)
+            {
+                if (pos + 40 > size)
+                {
+                    return false;
+                }
+                TableMeta m;
+                m.level = level;
+                m.fileName = fileName;
+                std::memcpy(&m.minK, data + pos, 8);
+                std::memcpy(&m.maxK, data + pos + 8, 8);
+                std::memcpy(&m.time, data + pos + 16, 8);
+                std::memcpy(&m.kvNum, data + pos + 24, 8);
+                std::memcpy(&m.fileSize, data + pos + 32, 8);
+                pos += 40;
+                l.push_back(std::move(m));
+            }
+            else if (type != PENDING)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/* 记录每层有哪些SSTable的版本日志，启动时回放得到SSTable集合，不需要扫描目录
+ * record格式与WAL相同：CheckSum(2) | 长度(4) | VersionEdit，每条record写入后fdatasync
+ * 启动时把回放的结果写成只有一条record的新文件，通过rename替换，避免日志无限增长
+ * 落盘和合并分别在各自的线程中调用apply，fd和日志的追加由fdMutex保护
+ */
+class Manifest
+{
+public:
+    const static size_t RECORDHEADER = 6;
+
+private:
+    std::string fileName;
+    int fd = -1;
+    std::mutex fdMutex;
+
+    bool writeAll(int f, const std::string &data)
+    {
+        const char *p = data.data();
+        size_t left = data.size();
+        while (left > 0)
+        {
+            ssize_t n = write(f, p, left);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("write manifest");
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        return true;
+    }
+
+    static std::string encodeRecord(const VersionEdit &edit)
+    {
+        const std::string &payload = edit.data();
+        std::string record;
+        record.reserve(RECORDHEADER + payload.size());
+        uint16_t checkSum = utils::crc16((const unsigned char *)payload.data(), payload.size());
+        uint32_t len = payload.size();
+        record.append((const char *)&checkSum, sizeof(checkSum));
+        record.append((const char *)&len, sizeof(len));
+        record.append(payload);
+        return record;
+    }
+
+    bool append(const VersionEdit &edit, bool sync)
+    {
+        if (edit.empty())
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(fdMutex);
+        if (fd < 0)
+        {
+            openLog();
+        }
+        return fd >= 0 && writeAll(fd, encodeRecord(edit)) && (!sync || fdatasync(fd) == 0);
+    }
+
+    void openLog()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            perror("open manifest");
+        }
+    }
+
+public:
+    Manifest(const std::string &dir) : fileName(dir + "/MANIFEST") {}
+    ~Manifest()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    bool exists() const
+    {
+        return access(fileName.c_str(), F_OK) == 0;
+    }
+
+    enum RecoverStatus
+    {
+        MISSING,   // 没有MANIFEST
+        RECOVERED, // 回放成功，末尾写了一半的record被忽略
+        CORRUPTED  // 有校验失败或无法解析的record，levels只包含它之前的部分
+    };
+
+    /* 按顺序回放所有record，garbage是不属于回放结果、可以删除的文件
+     * 只有长度超出文件末尾的最后一条record是崩溃时没有写完的，被忽略；其他错误说明文件损坏 */
+    RecoverStatus recover(std::vector<std::vector<TableMeta>> &levels, std::set<std::pair<int, std::string>> &garbage)
+    {
+        std::ifstream in(fileName, std::ios::binary);
+        if (!in.is_open())
+        {
+            return MISSING;
+        }
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t pos = 0;
+        while (pos + RECORDHEADER <= data.size())
+        {
+            uint16_t checkSum;
+            uint32_t len;
+            std::memcpy(&checkSum, data.data() + pos, sizeof(checkSum));
+            std::memcpy(&len, data.data() + pos + 2, sizeof(len));
+            if (pos + RECORDHEADER + len > data.size())
+            {
+                break; // 崩溃时未写完的record
+            }
+            const char *payload = data.data() + pos + RECORDHEADER;
+            if (utils::crc16((const unsigned char *)payload, len) != checkSum)
+            {
+                std::cerr << "MANIFEST: checksum mismatch at offset " << pos << " in " << fileName << std::endl;
+                return CORRUPTED;
+            }
+            // 无法解析时整个打开失败，不需要保证levels只应用了完整的record
+            if (!VersionEdit::apply(payload, len, levels, garbage))
+            {
+                std::cerr << "MANIFEST: corrupted record at offset " << pos << " in " << fileName << std::endl;
+                return CORRUPTED;
+            }
+            pos += RECORDHEADER + len;
+        }
+        return RECOVERED;
+    }
+
+    /* 用levels中的全部SSTable生成新的MANIFEST替换旧文件，之后的edit追加到新文件中 */
+    bool rewrite(const std::vector<std::vector<TableMeta>> &levels)
+    {
+        VersionEdit edit;
+        for (const std::vector<TableMeta> &l : levels)
+        {
+            for (const TableMeta &m : l)
+            {
+                edit.addTable(m);
+            }
+        }
+        std::string tmpName = fileName + ".tmp";
+        int f = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (f < 0)
+        {
+            perror("open manifest");
+            return false;
+        }
+        bool ok = writeAll(f, encodeRecord(edit)) && fdatasync(f) == 0;
+        close(f);
+        std::lock_guard<std::mutex> lock(fdMutex);
+        if (!ok || rename(tmpName.c_str(), fileName.c_str()) != 0)
+        {
+            utils::rmfile(tmpName);
+            return false;
+        }
+        // rename之后目录项也要落盘，否则崩溃后可能仍是旧的MANIFEST，而旧文件中记录的garbage已经被删除
+        if (!utils::syncDir(fileName))
+        {
+            perror("fsync manifest dir");
+        }
+        openLog();
+        return true;
+    }
+
+    // 追加一条edit并刷盘，返回之后这次变更在崩溃后也会生效，可以被多个线程同时调用
+    bool apply(const VersionEdit &edit)
+    {
+        return append(edit, true);
+    }
+
+    /* 追加只包含PENDING的edit，在写出文件之前调用，不刷盘
+     * 之后提交的edit刷盘时它也一起落盘；崩溃时丢失的话只会留下无用的文件，不影响正确性 */
+    bool prepare(const VersionEdit &edit)
+    {
+        return append(edit, false);
+    }
+
+    // 把文件刷到磁盘，在edit引用它之前调用
+    static bool syncFile(const std::string &path)
+    {
+        int f = open(path.c_str(), O_RDONLY);
+        if (f < 0)
+        {
+            return false;
+        }
+        bool ok = fdatasync(f) == 0;
+        close(f);
+        return ok;
+    }
+};
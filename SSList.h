@@ -4,124 +4,249 @@
 #include <fstream>
 #include <iostream>
 #include <cstdint>
+#include <algorithm>
 #include "ssTable.h"
 // 管理所有在磁盘的SSTable
 
-const size_t kovSize = 20;
 
 class SSList
 {
 public:
     // tables[l][i] 表示第l层的第i个SStable
     std::vector<std::vector<SSTable *>> tables;
-    std::vector<uint64_t> MAXSET;
-    std::vector<uint64_t> MINSET;
-    std::vector<uint64_t> TIMESTAMPSET;
-    SSList(){};
+    /* 查找用的有序视图，每次修改tables后由rebuildFences更新
+     * 第0层的SSTable之间键值范围有重叠，按时间戳从新到旧排列
+     * 其他层的SSTable键值范围互不相交，按键值排列，fenceMax[l][i]是ordered[l][i]的最大key */
+    std::vector<std::vector<SSTable *>> ordered;
+    std::vector<std::vector<uint64_t>> fenceMax;
+    // 所有SSTable共享的block缓存，未启用时为nullptr
+    SSTable::Cache *blockCache;
+    // 为true时读取SSTable只读header和过滤器，index在第一次查找时读取并放入indexCache
+    bool lazyIndex;
+    SSTable::IndexCache *indexCache;
+    // 所有SSTable共享的文件描述符缓存，最多同时打开maxOpenFiles个文件，为0时每次读取临时打开
+    FileCache *fileCache;
+    SSList(size_t blockCacheSize = 0, bool _lazyIndex = false, size_t indexCacheSize = 0, size_t maxOpenFiles = 0)
+        : blockCache(blockCacheSize > 0 ? new SSTable::Cache(blockCacheSize) : nullptr), lazyIndex(_lazyIndex),
+          indexCache(_lazyIndex && indexCacheSize > 0 ? new SSTable::IndexCache(indexCacheSize) : nullptr),
+          fileCache(maxOpenFiles > 0 ? new FileCache(maxOpenFiles) : nullptr){};
     ~SSList()
     {
         clear();
+        delete blockCache;
+        delete indexCache;
+        delete fileCache;
     };
-    // 通过层号，层的索引来读取SSTable
-    SSTable *readSSTable(int _level, int _id, std::fstream *in)
+    /* 通过层号，层的索引来读取SSTable，并加入tables
+     * fileName是in对应的文件，之后读取block时重新打开 */
+    SSTable *readSSTable(int _level, int _id, std::fstream *in, const std::string &fileName)
+    {
+        return addToList(_level, _id, loadSSTable(_level, _id, in, fileName));
+    }
+
+    /* 读取SSTable的header、过滤器和index(lazyIndex时不读取)，数据block在查找时读取
+     * 不修改tables，可以在多个线程中同时调用 */
+    SSTable *loadSSTable(int _level, int _id, std::fstream *in, const std::string &fileName) const
     {
         SSTable::Header header;
         // 读取头部
         in->read((char *)&header, sizeof(header));
+        in->clear();
+        in->seekg(0, std::ios::end);
+        uint64_t fileSize = in->tellg();
+        SSTable::Footer footer = SSTable::readFooter(*in, fileSize);
+        // 崩溃时没有写完的文件，无法确定各部分的位置
+        if (fileSize < sizeof(header) || footer.dataEnd < footer.dataOffset)
+        {
+            std::cerr << "Error: Truncated SSTable " << fileName << std::endl;
+            return nullptr;
+        }
         // 读取过滤器
-        std::vector<bool> bf(BFSIZE, 0);
-        char b;
-        std::vector<char> bfBuffer(BFSIZE / 8); // 由于每个bool占用一个bit，因此每8个bool占用一个字节
-        in->read(bfBuffer.data(), BFSIZE / 8);
-        for (size_t i = 0; i < BFSIZE; i += 8)
-        {
-            char b = bfBuffer[i / 8];
-            (b & (1 << 7)) && (bf[i] = 1);
-            (b & (1 << 6)) && (bf[i + 1] = 1);
-            (b & (1 << 5)) && (bf[i + 2] = 1);
-            (b & (1 << 4)) && (bf[i + 3] = 1);
-            (b & (1 << 3)) && (bf[i + 4] = 1);
-            (b & (1 << 2)) && (bf[i + 5] = 1);
-            (b & (1 << 1)) && (bf[i + 6] = 1);
-            (b & (1)) && (bf[i + 7] = 1);
-        }
-        std::vector<SSTable::KOVPari> data;
-        std::vector<char> dataBuffer(header.kv_nums * kovSize);
-        in->read(dataBuffer.data(), header.kv_nums * kovSize);
-        uint64_t key;
-        uint64_t offset;
-        uint32_t vlen;
-        for (uint64_t i = 0; i < header.kv_nums; i++)
-        {
-            size_t Offset = i * kovSize;
-            std::memcpy(&key, (dataBuffer.data() + Offset), 8);
-            std::memcpy(&offset, (dataBuffer.data() + Offset + 8), 8);
-            std::memcpy(&vlen, (dataBuffer.data() + Offset + 16), sizeof(vlen));
-            data.emplace_back(key, offset, vlen);
-        }
-        return addToList(_level, _id, header.time, bf, data);
+        std::vector<char> filterBuffer(footer.filterSize);
+        in->seekg(footer.filterOffset);
+        in->read(filterBuffer.data(), filterBuffer.size());
+        std::unique_ptr<Filter> filter = Filter::decode(footer.filterType, filterBuffer.data(), filterBuffer.size());
+        if (!filter)
+        {
+            // 过滤器损坏时不使用过滤器，每次查找都读取block
+            std::cerr << "Error: Invalid filter in " << fileName << std::endl;
+        }
+        std::shared_ptr<const SSTable::Index> index;
+        if (!lazyIndex)
+        {
+            // 最早的格式没有index，需要读一遍数据区切分block
+            uint64_t offset, size;
+            SSTable::indexRegion(footer, offset, size);
+            std::vector<char> buffer(size);
+            in->seekg(offset);
+            in->read(buffer.data(), size);
+            std::vector<SSTable::BlockHandle> blocks;
+            if (!*in || !SSTable::parseIndex(buffer.data(), size, footer, header.kv_nums, blocks))
+            {
+                std::cerr << "Error: Failed to read index of " << fileName << std::endl;
+                return nullptr;
+            }
+            index = std::make_shared<const SSTable::Index>(std::move(blocks));
+        }
+        return new SSTable(header, _level, _id, std::move(filter), std::move(index), footer, fileName, blockCache, indexCache, fileCache);
     }
 
-    // 添加SSTable
-    SSTable *addToList(int level, int id, uint64_t time, std::vector<bool> BF, std::vector<SSTable::KOVPari> &data)
+    /* 添加SSTable，tables[level]按id有序
+     * 一次加入多个SSTable时可以传入rebuild = false，全部加入后再调用一次rebuildFences */
+    SSTable *addToList(int level, int id, SSTable *s, bool rebuild = true)
     {
-        SSTable *s = new SSTable(data, level, id, BF, time);
         // 如果需要创建新层
-        while ((int)(tables.size() - 1) < level)
+        addLevels(level + 1);
+        // 插入到第一个id更大的SSTable之前，id递增加入时直接追加在末尾
+        std::vector<SSTable *> &l = tables[level];
+        l.insert(std::upper_bound(l.begin(), l.end(), id, [](int id, SSTable *t)
+                                  { return id < t->getId(); }),
+                 s);
+        if (rebuild)
         {
-            tables.push_back(std::vector<SSTable *>());
+            rebuildFences(level);
         }
-        bool flag = true;
-        for (std::vector<SSTable *>::iterator it = tables[level].begin(); it != tables[level].end(); it++)
+        return s;
+    }
+
+    // 保证至少有levels层，新的层为空
+    void addLevels(size_t levels)
+    {
+        if (tables.size() < levels)
         {
-            if (id < (*it)->getId())
-            {
-                tables[level].insert(it, s);
-                flag = false;
-                break;
-            }
+            tables.resize(levels);
+        }
+        if (ordered.size() < levels)
+        {
+            ordered.resize(levels);
+            fenceMax.resize(levels);
+        }
+    }
+
+    // 更新level层的有序视图
+    void rebuildFences(int level)
+    {
+        addLevels(level + 1);
+        std::vector<SSTable *> &o = ordered[level];
+        o = tables[level];
+        if (level == 0)
+        {
+            std::sort(o.begin(), o.end(), [](SSTable *a, SSTable *b)
+                      { return a->getTime() > b->getTime(); });
+            return;
+        }
+        std::sort(o.begin(), o.end(), [](SSTable *a, SSTable *b)
+                  { return a->minK() < b->minK(); });
+        fenceMax[level].clear();
+        for (SSTable *t : o)
+        {
+            fenceMax[level].push_back(t->maxK());
         }
+    }
 
-        if (flag == true)
+    // level层(level > 0)中键值范围包含key的SSTable，没有则返回nullptr
+    SSTable *findTable(int level, uint64_t key) const
+    {
+        const std::vector<uint64_t> &f = fenceMax[level];
+        size_t i = branchlessLowerBound(f.data(), f.size(), key);
+        if (i == f.size() || ordered[level][i]->minK() > key)
         {
-            tables[level].push_back(s);
+            return nullptr;
         }
-        return s;
+        return ordered[level][i];
     }
-    // 由key返回对应SSTable的指针并设置offset 、vlen的参数
-    SSTable *search(uint64_t key, uint64_t &offset, uint32_t &vlen)
+    /* 由key返回对应SSTable的指针并设置offset 、vlen的参数，value直接存放在SSTable中时设置value
+     * 第0层从新到旧查找，第一个找到的就是最新的；其他层每层最多只有一个SSTable可能包含key */
+    SSTable *search(uint64_t key, uint64_t &offset, uint32_t &vlen, std::string &value)
     {
-        SSTable *s = nullptr;
-        bool flag = false;
+        if (!ordered.empty())
+        {
+            for (SSTable *t : ordered[0])
+            {
+                if (t->get(key, offset, vlen, value))
+                {
+                    return t;
+                }
+            }
+        }
+        for (size_t i = 1; i < ordered.size(); i++)
+        {
+            SSTable *t = findTable(i, key);
+            if (t && t->get(key, offset, vlen, value))
+            {
+                return t;
+            }
+        }
+        return nullptr;
+    }
 
-        uint64_t tmpOffset = 0;
-        uint32_t tmpVlen = 0;
+    struct Location
+    {
+        SSTable *table = nullptr; // 没找到为nullptr
+        uint64_t offset = 0;
+        uint32_t vlen = 0;
+    };
 
-        size_t tSize = tables.size();
-        for (size_t i = 0; i < tSize; i++)
+    /* 批量查找，keys按升序排列(可以重复)，每个key的结果与search相同
+     * 逐层处理还没有找到的key，每个SSTable的索引只和落在它键值范围内的key归并一次 */
+    void searchBatch(const std::vector<uint64_t> &keys, std::vector<Location> &res)
+    {
+        res.assign(keys.size(), Location());
+        std::vector<size_t> pending(keys.size()); // 还没找到的key的下标，保持升序
+        for (size_t i = 0; i < keys.size(); i++)
         {
-            size_t tiSize = tables[i].size();
-            for (size_t j = 0; j < tiSize; j++)
+            pending[i] = i;
+        }
+        for (size_t i = 0; i < tables.size() && !pending.empty(); i++)
+        {
+            for (SSTable *t : tables[i])
             {
-                if (tables[i][j]->get(key, tmpOffset, tmpVlen))
+                if (t->maxK() < keys[pending.front()] || t->minK() > keys[pending.back()])
                 {
-                    // 如果为空就直接更改s，如果非空需要对时间戳进行比较，用较大的时间戳替换较小的时间戳，保证数据是最新的
-                    if ((s == nullptr) || ((s != nullptr) && (tables[i][j]->getTime() > s->getTime())))
+                    continue;
+                }
+                auto p = std::lower_bound(pending.begin(), pending.end(), t->minK(), [&keys](size_t a, uint64_t k)
+                                          { return keys[a] < k; });
+                // 第一次需要读block时才取得index，相邻的key大多落在同一个block中
+                std::shared_ptr<const SSTable::Index> index;
+                std::shared_ptr<const SSTable::Block> block;
+                size_t blockIdx = 0;
+                size_t j = 0;
+                for (; p != pending.end() && keys[*p] <= t->maxK(); ++p)
+                {
+                    uint64_t key = keys[*p];
+                    if (!t->mayContain(key))
+                    {
+                        continue;
+                    }
+                    if (!index)
+                    {
+                        index = t->getIndex();
+                    }
+                    size_t b = index->findBlock(key);
+                    if (!block || b != blockIdx)
                     {
-                        s = tables[i][j];
-                        offset = tmpOffset;
-                        vlen = tmpVlen;
-                        flag = true;
+                        block = t->readBlock(*index, b);
+                        blockIdx = b;
+                        j = 0;
+                    }
+                    // key升序，只需要在上一次的位置之后查找
+                    j += branchlessLowerBound(block->keys.data() + j, block->size() - j, key);
+                    // 同一层中取时间戳最大的
+                    Location &loc = res[*p];
+                    if (j != block->size() && block->keys[j] == key && (!loc.table || t->getTime() > loc.table->getTime()))
+                    {
+                        loc.table = t;
+                        loc.offset = block->offsets[j];
+                        loc.vlen = block->vlens[j];
                     }
                 }
             }
-            // 找到了直接返回
-            if (flag)
-            {
-                break;
-            }
+            // 在这一层找到的key不需要再往下找
+            pending.erase(std::remove_if(pending.begin(), pending.end(), [&res](size_t a)
+                                         { return res[a].table != nullptr; }),
+                          pending.end());
         }
-        return s;
     }
 
     void scan(uint64_t key1, uint64_t key2, std::map<uint64_t, std::string> &RMap)
@@ -160,44 +285,52 @@ public:
         }
     }
 
-    // 删除缓存文件
-    void deleteTable(int level, int id)
+    /* 从level层中移除removed中的SSTable并按顺序重排id，SSTable对象由调用者释放
+     * 调用者需保证此时没有读者正在使用这些SSTable */
+    void removeTables(int level, const std::vector<SSTable *> &removed)
     {
-        for (std::vector<SSTable *>::iterator it = tables[level].begin(); it != tables[level].end(); it++)
+        if (removed.empty())
         {
-            if ((*it)->getId() == id)
-            {
-                tables[level].erase(it);
-                break;
-            }
+            return;
         }
+        std::vector<SSTable *> &l = tables[level];
+        l.erase(std::remove_if(l.begin(), l.end(), [&removed](SSTable *t)
+                               { return std::find(removed.begin(), removed.end(), t) != removed.end(); }),
+                l.end());
+        for (size_t i = 0; i < l.size(); i++)
+        {
+            l[i]->changeId(i);
+        }
+        rebuildFences(level);
     }
-    // 返回level层键值与minK到maxK有交集的所有SSTable的id，并在tables里删除这些索引，重排id
-    std::vector<int> Intersection(int level, uint64_t minK, uint64_t maxK)
-    {
-        std::vector<int> a;
-        MAXSET.clear();
-        MINSET.clear();
-        this->TIMESTAMPSET.clear();
 
-        for (std::vector<SSTable *>::iterator it = tables[level].begin(); it != tables[level].end(); it++)
+    // 返回level层键值与minK到maxK有交集的所有SSTable
+    std::vector<SSTable *> overlapping(int level, uint64_t minK, uint64_t maxK) const
+    {
+        std::vector<SSTable *> a;
+        for (SSTable *t : tables[level])
         {
-            if (!(((*it)->minK() > maxK) || ((*it)->maxK() < minK)))
+            if (!(t->minK() > maxK || t->maxK() < minK))
             {
-                a.push_back((*it)->getId());
-                MAXSET.push_back((*it)->maxK());
-                MINSET.push_back((*it)->minK());
-                TIMESTAMPSET.push_back((*it)->getTime());
-                tables[level].erase(it);
-                it--;
+                a.push_back(t);
             }
         }
-        int num = tables[level].size();
-        for (int i = 0; i < num; i++)
+        return a;
+    }
+
+    // level层所有SSTable文件的总字节数
+    uint64_t levelBytes(int level) const
+    {
+        uint64_t bytes = 0;
+        if ((size_t)level >= tables.size())
         {
-            tables[level][i]->changeId(i);
+            return 0;
         }
-        return a;
+        for (SSTable *t : tables[level])
+        {
+            bytes += t->fileBytes();
+        }
+        return bytes;
     }
 
     // 将level层中为oldid的文件更新为newid
@@ -224,5 +357,15 @@ public:
             tables[i].clear();
         }
         tables.clear();
+        ordered.clear();
+        fenceMax.clear();
+        if (blockCache)
+        {
+            blockCache->clear();
+        }
+        if (indexCache)
+        {
+            indexCache->clear();
+        }
     }
 };
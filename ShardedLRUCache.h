@@ -0,0 +1,166 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <map>
+#include <type_traits>
+
+/* 以uint64_t为键的缓存，分成若干个shard，每个shard独立加锁并按LRU淘汰，总大小不超过capacity字节
+ * 每一项的大小(charge)由插入者给出；ValueCache、BlockCache和FileCache都基于它实现
+ * Ordered为true时shard的索引按键排序，可以按范围删除，查找变为O(log n)
+ */
+template <typename Value, bool Ordered = false>
+class ShardedLRUCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        size_t usage; // 当前缓存的字节数
+    };
+
+private:
+    const static int SHARDNUM = 16;
+
+    struct Entry
+    {
+        uint64_t key;
+        Value value;
+        size_t charge;
+    };
+
+    typedef typename std::list<Entry>::iterator Handle;
+    typedef typename std::conditional<Ordered, std::map<uint64_t, Handle>, std::unordered_map<uint64_t, Handle>>::type Index;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<Entry> lru; // 越靠前越新
+        Index index;
+        size_t usage = 0;
+        size_t capacity = 0;
+
+        void evict()
+        {
+            while (usage > capacity && !lru.empty())
+            {
+                usage -= lru.back().charge;
+                index.erase(lru.back().key);
+                lru.pop_back();
+            }
+        }
+    };
+
+    Shard shards[SHARDNUM];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+    Shard &shardOf(uint64_t key)
+    {
+        // 键的低位可能分布不均(例如vLog的offset)，先打散
+        uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+        return shards[h >> 60];
+    }
+
+public:
+    ShardedLRUCache(size_t capacity)
+    {
+        for (Shard &s : shards)
+        {
+            s.capacity = capacity / SHARDNUM;
+        }
+    }
+    ~ShardedLRUCache() {}
+
+    // 命中时拷贝到value并返回true
+    bool lookup(uint64_t key, Value &value)
+    {
+        Shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it == s.index.end())
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        value = it->second->value;
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 已经存在的键不会被覆盖，超过一个shard容量的项不缓存
+    void insert(uint64_t key, const Value &value, size_t charge)
+    {
+        Shard &s = shardOf(key);
+        if (charge > s.capacity)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.index.find(key) != s.index.end())
+        {
+            return;
+        }
+        s.lru.push_front(Entry{key, value, charge});
+        s.index[key] = s.lru.begin();
+        s.usage += charge;
+        s.evict();
+    }
+
+    void erase(uint64_t key)
+    {
+        Shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it != s.index.end())
+        {
+            s.usage -= it->second->charge;
+            s.lru.erase(it->second);
+            s.index.erase(it);
+        }
+    }
+
+    // 删除键在[begin, end)内的项，每个shard中只访问范围内的项
+    void eraseRange(uint64_t begin, uint64_t end)
+    {
+        static_assert(Ordered, "eraseRange needs an ordered index");
+        for (Shard &s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto first = s.index.lower_bound(begin);
+            auto last = s.index.lower_bound(end);
+            for (auto it = first; it != last; ++it)
+            {
+                s.usage -= it->second->charge;
+                s.lru.erase(it->second);
+            }
+            s.index.erase(first, last);
+        }
+    }
+
+    void clear()
+    {
+        for (Shard &s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.lru.clear();
+            s.index.clear();
+            s.usage = 0;
+        }
+    }
+
+    Stats getStats()
+    {
+        Stats st{hits.load(), misses.load(), 0};
+        for (Shard &s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            st.usage += s.usage;
+        }
+        return st;
+    }
+};
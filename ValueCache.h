@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "ShardedLRUCache.h"
+
+/* vLog前面的value缓存，以value在vLog中的offset为键，按value的长度计算大小
+ * gc回收vLog的一段区域或者reset之后需要让对应的缓存失效
+ * 索引按offset排序，回收一个segment时通过eraseRange只删除这个segment中的缓存，不扫描整个shard
+ */
+class ValueCache : public ShardedLRUCache<std::string, true>
+{
+public:
+    ValueCache(size_t capacity) : ShardedLRUCache<std::string, true>(capacity) {}
+
+    void insert(uint64_t offset, const std::string &value)
+    {
+        ShardedLRUCache<std::string, true>::insert(offset, value, value.size());
+    }
+};
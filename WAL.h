@@ -0,0 +1,287 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cerrno>
+#include <deque>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "utils.h"
+#include "WriteBatch.h"
+
+/* WAL的刷盘策略 */
+enum class WALSyncMode
+{
+    ALWAYS,   // 每次写入后fdatasync
+    INTERVAL, // 后台线程每隔一段时间把新写入的数据刷盘
+    NONE      // 只写入操作系统缓存
+};
+
+/* 预写日志，保证MemTable中的数据在崩溃后可以恢复
+ * 每个MemTable对应一个log文件 wal-<number>.log，MemTable落盘后删除对应的log
+ * log由若干record组成：CheckSum(2) | 长度(4) | 内容
+ * 内容是一个或多个WriteBatch的编码
+ * append和rotate由调用者保证不会同时进行，后台刷盘线程通过fdMutex与更换文件互斥
+ */
+class WAL
+{
+public:
+    const static size_t RECORDHEADER = 6;
+
+private:
+    std::string dir;
+    WALSyncMode mode;
+    std::chrono::milliseconds interval;
+    int fd = -1;
+    off_t logSize = 0;               // 当前log中完整写入的record的总长度
+    std::atomic<bool> dirty{false}; // 当前log有没有刷盘的数据
+    std::mutex fdMutex;
+    std::thread syncThread;
+    std::condition_variable syncCv;
+    bool stopSync = false;
+    // 仍然需要保留的log编号，最后一个是当前正在写入的log
+    std::deque<uint64_t> logs;
+
+    std::string fileName(uint64_t number) const
+    {
+        return dir + "/wal-" + std::to_string(number) + ".log";
+    }
+
+    void openLog(uint64_t number)
+    {
+        std::lock_guard<std::mutex> lock(fdMutex);
+        if (fd >= 0)
+        {
+            // 旧log中还没有刷盘的数据在关闭前刷盘
+            if (dirty.exchange(false))
+            {
+                sync();
+            }
+            close(fd);
+        }
+        fd = open(fileName(number).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            perror("open wal");
+        }
+        logSize = fd < 0 ? 0 : lseek(fd, 0, SEEK_END);
+        logs.push_back(number);
+    }
+
+    // 按编号列出目录中已有的log
+    std::vector<uint64_t> listLogs() const
+    {
+        std::vector<uint64_t> numbers;
+        if (!utils::dirExists(dir))
+        {
+            return numbers;
+        }
+        std::vector<std::string> files;
+        utils::scanDir(dir, files);
+        for (const std::string &f : files)
+        {
+            if (f.compare(0, 4, "wal-") == 0 && f.size() > 8 && f.compare(f.size() - 4, 4, ".log") == 0)
+            {
+                numbers.push_back(std::stoull(f.substr(4, f.size() - 8)));
+            }
+        }
+        std::sort(numbers.begin(), numbers.end());
+        return numbers;
+    }
+
+    bool sync()
+    {
+        if (fdatasync(fd) != 0)
+        {
+            perror("fdatasync wal");
+            return false;
+        }
+        return true;
+    }
+
+    // 丢弃logSize之后没有成功写入的数据
+    void truncate()
+    {
+        if (fd >= 0 && ftruncate(fd, logSize) != 0)
+        {
+            perror("ftruncate wal");
+        }
+    }
+
+    // INTERVAL策略下每隔interval把新写入的数据刷盘，写入停止之后最后的数据也会在interval内刷盘
+    void syncLoop()
+    {
+        std::unique_lock<std::mutex> lock(fdMutex);
+        while (!stopSync)
+        {
+            syncCv.wait_for(lock, interval, [this]()
+                            { return stopSync; });
+            if (fd >= 0 && dirty.exchange(false))
+            {
+                sync();
+            }
+        }
+    }
+
+public:
+    WAL(const std::string &_dir, WALSyncMode _mode, uint32_t intervalMs)
+        : dir(_dir), mode(_mode), interval(intervalMs)
+    {
+        // 间隔为0时等同于每次写入都刷盘
+        if (mode == WALSyncMode::INTERVAL && intervalMs == 0)
+        {
+            mode = WALSyncMode::ALWAYS;
+        }
+        if (mode == WALSyncMode::INTERVAL)
+        {
+            syncThread = std::thread(&WAL::syncLoop, this);
+        }
+    }
+    ~WAL()
+    {
+        if (syncThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(fdMutex);
+                stopSync = true;
+                syncCv.notify_all();
+            }
+            syncThread.join();
+        }
+        if (fd >= 0)
+        {
+            if (dirty)
+            {
+                sync();
+            }
+            close(fd);
+        }
+    }
+
+    /* 按顺序回放目录中所有的log，遇到不完整或校验失败的record就停止该文件的回放
+     * 回放结束后这些log仍然保留，直到调用者确认数据已经落盘后调用removeRecovered
+     */
+    void recover(const std::function<void(uint8_t, uint64_t, std::string &&)> &handler)
+    {
+        for (uint64_t number : listLogs())
+        {
+            std::ifstream in(fileName(number), std::ios::binary);
+            std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            size_t pos = 0;
+            while (pos + RECORDHEADER <= data.size())
+            {
+                uint16_t checkSum;
+                uint32_t len;
+                std::memcpy(&checkSum, data.data() + pos, sizeof(checkSum));
+                std::memcpy(&len, data.data() + pos + 2, sizeof(len));
+                if (pos + RECORDHEADER + len > data.size())
+                {
+                    break; // 崩溃时未写完的record
+                }
+                const char *payload = data.data() + pos + RECORDHEADER;
+                if (utils::crc16((const unsigned char *)payload, len) != checkSum)
+                {
+                    std::cerr << "WAL: checksum mismatch in " << fileName(number) << std::endl;
+                    break;
+                }
+                WriteBatch::decode(payload, len, handler);
+                pos += RECORDHEADER + len;
+            }
+            logs.push_back(number);
+        }
+    }
+
+    // 删除回放过的log，开始写新的log
+    void removeRecovered()
+    {
+        uint64_t next = logs.empty() ? 1 : logs.back() + 1;
+        {
+            std::lock_guard<std::mutex> lock(fdMutex);
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            dirty = false;
+        }
+        for (uint64_t number : logs)
+        {
+            utils::rmfile(fileName(number));
+        }
+        logs.clear();
+        openLog(next);
+    }
+
+    /* 追加一条record，并按照刷盘策略决定是否fdatasync
+     * 写入失败时截掉写了一半的record，保证之后的record仍然可以回放，返回false */
+    bool append(const std::string &payload)
+    {
+        std::string record;
+        record.reserve(RECORDHEADER + payload.size());
+        uint16_t checkSum = utils::crc16((const unsigned char *)payload.data(), payload.size());
+        uint32_t len = payload.size();
+        record.append((const char *)&checkSum, sizeof(checkSum));
+        record.append((const char *)&len, sizeof(len));
+        record.append(payload);
+
+        const char *p = record.data();
+        size_t left = record.size();
+        while (left > 0)
+        {
+            ssize_t n = write(fd, p, left);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("write wal");
+                truncate();
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+
+        if (mode == WALSyncMode::ALWAYS && !sync())
+        {
+            truncate();
+            return false;
+        }
+        logSize += record.size();
+        if (mode == WALSyncMode::INTERVAL)
+        {
+            dirty = true;
+        }
+        return true;
+    }
+
+    // MemTable转为immTable时调用，之后的写入进入新的log
+    void rotate()
+    {
+        openLog(logs.back() + 1);
+    }
+
+    // 最旧的immTable已经落盘，删除它对应的log
+    void releaseOldest()
+    {
+        if (logs.size() > 1)
+        {
+            utils::rmfile(fileName(logs.front()));
+            logs.pop_front();
+        }
+    }
+
+    // 删除所有log，重新开始
+    void reset()
+    {
+        removeRecovered();
+    }
+};
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <functional>
+
+/* 一组需要原子写入的put/del
+ * 所有操作编码在一块连续的缓冲区中，启用WAL时整体作为一条record写入
+ * 每个操作的编码：类型(1) | Key(8) | vlen(4) | Value
+ */
+class WriteBatch
+{
+public:
+    enum OpType : uint8_t
+    {
+        DEL = 0,
+        PUT = 1
+    };
+    const static size_t OPHEADER = 13;
+
+private:
+    std::string rep;
+    size_t count = 0;
+
+    void append(uint8_t type, uint64_t key, const char *value, uint32_t vlen)
+    {
+        rep.push_back((char)type);
+        rep.append((const char *)&key, sizeof(key));
+        rep.append((const char *)&vlen, sizeof(vlen));
+        rep.append(value, vlen);
+        ++count;
+    }
+
+public:
+    WriteBatch() {}
+    ~WriteBatch() {}
+
+    void put(uint64_t key, const std::string &value)
+    {
+        append(PUT, key, value.data(), value.size());
+    }
+
+    void del(uint64_t key)
+    {
+        append(DEL, key, nullptr, 0);
+    }
+
+    // 把另一个batch的操作追加到末尾
+    void append(const WriteBatch &other)
+    {
+        rep.append(other.rep);
+        count += other.count;
+    }
+
+    void clear()
+    {
+        rep.clear();
+        count = 0;
+    }
+
+    // 操作的数量
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    const std::string &data() const
+    {
+        return rep;
+    }
+
+    // 按写入顺序遍历所有操作
+    void iterate(const std::function<void(uint8_t, uint64_t, std::string &&)> &handler) const
+    {
+        decode(rep.data(), rep.size(), handler);
+    }
+
+    /* 解析编码后的操作，对每个操作调用handler
+     * 返回false表示内容不完整
+     */
+    static bool decode(const char *data, size_t size,
+                       const std::function<void(uint8_t, uint64_t, std::string &&)> &handler)
+    {
+        size_t pos = 0;
+        while (pos < size)
+        {
+            if (pos + OPHEADER > size)
+            {
+                return false;
+            }
+            uint8_t type = data[pos];
+            uint64_t key;
+            uint32_t vlen;
+            std::memcpy(&key, data + pos + 1, sizeof(key));
+            std::memcpy(&vlen, data + pos + 9, sizeof(vlen));
+            pos += OPHEADER;
+            if (pos + vlen > size)
+            {
+                return false;
+            }
+            handler(type, key, std::string(data + pos, vlen));
+            pos += vlen;
+        }
+        return true;
+    }
+};
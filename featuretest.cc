@@ -0,0 +1,1234 @@
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <chrono>
+
+#include "test.h"
+
+/* 各个扩展功能的行为测试，每个测试使用./data下单独的目录和各自的KVStoreOptions */
+class FeatureTest : public Test
+{
+private:
+	const std::string dir;
+
+	// 每个测试的KVStore放在dir/name下
+	std::string storeDir(const std::string &name) const
+	{
+		return dir + "/" + name;
+	}
+
+	static std::string value(uint64_t key, unsigned writer)
+	{
+		return std::to_string(key) + "-" + std::to_string(writer) + std::string(key % 100, 'v');
+	}
+
+	// 返回value中记录的写入线程，格式不对返回-1
+	static int writerOf(uint64_t key, const std::string &v)
+	{
+		std::string prefix = std::to_string(key) + "-";
+		if (v.compare(0, prefix.size(), prefix) != 0)
+		{
+			return -1;
+		}
+		size_t end = v.find('v', prefix.size());
+		std::string w = v.substr(prefix.size(), end == std::string::npos ? std::string::npos : end - prefix.size());
+		return w.empty() ? -1 : std::stoi(w);
+	}
+
+	/* 多个线程并发插入同一个MemTable，一半的key所有线程都会写入
+	 * 插入结束后每个key恰好有一个节点，按顺序排列，value是某个线程写入的完整value */
+	void memtable_test(unsigned threadNum, uint64_t max)
+	{
+		MemTable mem(64);
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < threadNum; t++)
+		{
+			threads.emplace_back([&mem, t, threadNum, max]()
+								 {
+				for (uint64_t i = 0; i < max; i++)
+				{
+					// 偶数key所有线程都写，奇数key只由一个线程写
+					uint64_t key = (i * 7919 + t * 104729) % max;
+					if (key % 2 == 0 || key % threadNum == t)
+					{
+						mem.put(key, value(key, t));
+					}
+				} });
+		}
+		for (std::thread &th : threads)
+		{
+			th.join();
+		}
+
+		EXPECT((size_t)max, mem.size());
+		uint64_t expectKey = 0;
+		mem.forEach([this, &expectKey, threadNum](uint64_t key, const char *v, uint32_t vlen)
+					{
+			EXPECT(expectKey, key);
+			int w = writerOf(key, std::string(v, vlen));
+			EXPECT(true, w >= 0 && (unsigned)w < threadNum);
+			expectKey = key + 1; });
+		EXPECT(max, expectKey);
+		for (uint64_t i = 0; i < max; i++)
+		{
+			int w = writerOf(i, mem.get(i));
+			EXPECT(true, w >= 0 && value(i, w) == mem.get(i));
+		}
+
+		phase();
+	}
+
+	/* 关闭WAL时put直接并发写入memTable，多个线程写入不相交的key，期间memTable会多次写满落盘 */
+	void concurrent_put_test(unsigned threadNum, uint64_t max)
+	{
+		KVStoreOptions options;
+		options.useWAL = false;
+		KVStore s(storeDir("mt"), storeDir("mt") + "/vlog", options);
+		s.reset();
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < threadNum; t++)
+		{
+			threads.emplace_back([&s, t, threadNum, max]()
+								 {
+				for (uint64_t i = t; i < max; i += threadNum)
+				{
+					s.put(i, value(i, t));
+				} });
+		}
+		for (std::thread &th : threads)
+		{
+			th.join();
+		}
+		for (uint64_t i = 0; i < max; i++)
+		{
+			EXPECT(value(i, i % threadNum), s.get(i));
+		}
+
+		phase();
+	}
+
+	// 第round轮batch中key的value，一部分短到直接存放在SSTable中
+	static std::string batchValue(uint64_t round, uint64_t key)
+	{
+		return std::to_string(round) + "-" + std::string(key % 3 == 0 ? 8 : 100 + key, 'b');
+	}
+
+	// 第round轮的batch：覆盖key 0..keys-1，写入一个新key并删除上一轮写入的key
+	static void fillBatch(WriteBatch &batch, uint64_t round, uint64_t keys)
+	{
+		batch.clear();
+		for (uint64_t i = 0; i < keys; i++)
+		{
+			batch.put(i, batchValue(round, i));
+		}
+		batch.put(keys + round % 2, batchValue(round, keys));
+		batch.del(keys + 1 - round % 2);
+	}
+
+	/* batch中的操作按顺序生效，同一个batch中对一个key的后一次操作覆盖前一次 */
+	void write_batch_test(uint64_t keys)
+	{
+		KVStoreOptions options;
+		KVStore s(storeDir("batch"), storeDir("batch") + "/vlog", options);
+		s.reset();
+		WriteBatch batch;
+		EXPECT(true, s.write(batch));
+		for (uint64_t round = 0; round < 4; round++)
+		{
+			fillBatch(batch, round, keys);
+			EXPECT(true, s.write(batch));
+			for (uint64_t i = 0; i < keys; i++)
+			{
+				EXPECT(batchValue(round, i), s.get(i));
+			}
+			EXPECT(batchValue(round, keys), s.get(keys + round % 2));
+			EXPECT(not_found, s.get(keys + 1 - round % 2));
+		}
+		batch.clear();
+		batch.put(keys + 2, "first");
+		batch.del(keys + 2);
+		batch.put(keys + 3, "first");
+		batch.put(keys + 3, "second");
+		EXPECT(true, s.write(batch));
+		EXPECT(not_found, s.get(keys + 2));
+		EXPECT(std::string("second"), s.get(keys + 3));
+
+		phase();
+	}
+
+	/* 子进程不断写入batch时被杀死，重新打开后所有key必须来自同一轮batch
+	 * 每个batch是WAL中的一条record，回放时要么全部生效要么都不生效 */
+	void write_batch_crash_test(uint64_t keys)
+	{
+		std::string path = storeDir("batch");
+		{
+			KVStore s(path, path + "/vlog");
+			s.reset();
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			KVStore s(path, path + "/vlog");
+			WriteBatch batch;
+			for (uint64_t round = 0;; round++)
+			{
+				fillBatch(batch, round, keys);
+				s.write(batch);
+			}
+		}
+		if (pid < 0)
+		{
+			perror("fork");
+			return;
+		}
+		usleep(500 * 1000);
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+
+		KVStore s(path, path + "/vlog");
+		std::string first = s.get(0);
+		uint64_t round = first.empty() ? 0 : std::stoull(first.substr(0, first.find('-')));
+		EXPECT(false, first.empty());
+		for (uint64_t i = 0; i < keys; i++)
+		{
+			EXPECT(batchValue(round, i), s.get(i));
+		}
+		EXPECT(batchValue(round, keys), s.get(keys + round % 2));
+		EXPECT(not_found, s.get(keys + 1 - round % 2));
+		s.reset();
+
+		phase();
+	}
+
+	/* XOR8过滤器：编码后再解码，所有key都必须命中，不存在的key误判率应在1%以下(理论值约0.4%)
+	 * 重复的key只计一次，编码不完整时解码失败 */
+	void xor_filter_test()
+	{
+		for (uint64_t n : {1, 100, 1000, 50000})
+		{
+			std::vector<uint64_t> keys;
+			for (uint64_t i = 0; i < n; i++)
+			{
+				keys.push_back(i * 3);
+				if (i % 10 == 0)
+				{
+					keys.push_back(i * 3);
+				}
+			}
+			FilterPolicy policy;
+			policy.type = FilterType::XOR8;
+			std::string data;
+			Filter::build(policy, keys, data);
+			EXPECT(true, data.size() < 64 + n * 3 / 2);
+			std::unique_ptr<Filter> filter = Filter::decode(FilterType::XOR8, data.data(), data.size());
+			EXPECT(true, filter != nullptr);
+			EXPECT(true, Filter::decode(FilterType::XOR8, data.data(), data.size() - 1) == nullptr);
+			if (!filter)
+			{
+				continue;
+			}
+			EXPECT(true, filter->type() == FilterType::XOR8);
+			for (uint64_t key : keys)
+			{
+				EXPECT(true, filter->mayContain(key));
+			}
+			uint64_t falsePositives = 0;
+			const uint64_t probes = 100000;
+			for (uint64_t i = 0; i < probes; i++)
+			{
+				falsePositives += filter->mayContain(i * 3 + 1);
+			}
+			EXPECT(true, falsePositives * 100 < probes);
+		}
+
+		phase();
+	}
+
+	/* 深层使用XOR8、第0层使用BLOCKED_BLOOM时读取正确，重新打开和改用默认过滤器打开后也正确 */
+	void xor_store_test(uint64_t max)
+	{
+		KVStoreOptions options;
+		options.levelFilterTypes = {FilterType::BLOCKED_BLOOM, FilterType::XOR8};
+		std::string path = storeDir("xor");
+		auto check = [this, max](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(i % 7 == 0 ? not_found : std::string(i % 50 + 1, 'x'), s.get(i));
+			}
+			for (uint64_t i = max; i < max + 1000; i++)
+			{
+				EXPECT(not_found, s.get(i));
+			}
+		};
+		{
+			KVStore s(path, path + "/vlog", options);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'x'));
+			}
+			for (uint64_t i = 0; i < max; i += 7)
+			{
+				s.del(i);
+			}
+			s.waitForCompaction();
+			check(s);
+		}
+		{
+			KVStore s(path, path + "/vlog", options);
+			check(s);
+		}
+		{
+			KVStore s(path, path + "/vlog");
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	static bool fileExists(const std::string &path)
+	{
+		return access(path.c_str(), F_OK) == 0;
+	}
+
+	static void appendFile(const std::string &path, const std::string &data)
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::app);
+		out.write(data.data(), data.size());
+	}
+
+	static uint64_t fileSize(const std::string &path)
+	{
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		return in.is_open() ? (uint64_t)in.tellg() : 0;
+	}
+
+	static void flipByte(const std::string &path, uint64_t offset)
+	{
+		std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+		char c = 0;
+		f.seekg(offset);
+		f.get(c);
+		f.seekp(offset);
+		f.put(c ^ 0x40);
+	}
+
+	// 各层目录中SSTable文件的总数
+	static size_t countTables(const std::string &path)
+	{
+		size_t n = 0;
+		for (int level = 0; utils::dirExists(path + "/level-" + std::to_string(level)); level++)
+		{
+			std::vector<std::string> files;
+			n += utils::scanDir(path + "/level-" + std::to_string(level), files);
+		}
+		return n;
+	}
+
+	// 打开path下的store，打开失败(抛出异常)返回false
+	static bool opens(const std::string &path)
+	{
+		try
+		{
+			KVStore s(path, path + "/vlog");
+			return true;
+		}
+		catch (const std::runtime_error &)
+		{
+			return false;
+		}
+	}
+
+	/* 重新打开时从MANIFEST恢复SSTable集合
+	 * 崩溃前没有提交的输出(只有PENDING记录)被删除，MANIFEST末尾不完整的record被忽略，其他损坏使打开失败
+	 * 没有MANIFEST的旧数据通过扫描目录打开，之后生成MANIFEST */
+	void manifest_test(uint64_t max)
+	{
+		std::string path = storeDir("manifest");
+		std::string manifestFile = path + "/MANIFEST";
+		auto check = [this, max](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(std::string(i % 50 + 1, i % 2 ? 'a' : 'b'), s.get(i));
+			}
+		};
+		{
+			KVStore s(path, path + "/vlog");
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'a'));
+			}
+			for (uint64_t i = 0; i < max; i += 2)
+			{
+				s.put(i, std::string(i % 50 + 1, 'b'));
+			}
+			s.waitForCompaction();
+			check(s);
+		}
+		EXPECT(true, fileExists(manifestFile));
+		{
+			KVStore s(path, path + "/vlog");
+			check(s);
+		}
+
+		/* 没有提交的输出：MANIFEST中有PENDING但没有ADD的文件，一个不完整，一个与已有SSTable内容相同
+		 * MANIFEST中没有记录过的文件不是这个store写出的，不会被删除 */
+		std::string level1 = path + "/level-1/";
+		std::vector<std::string> tables;
+		utils::scanDir(level1, tables);
+		EXPECT(false, tables.empty());
+		std::string orphan = "SSTable0-1-time:999999.sst";
+		std::string orphan0 = path + "/level-0/" + orphan;
+		std::string orphan1 = level1 + orphan;
+		std::string stranger = level1 + "SSTable0-2-time:999999.sst";
+		appendFile(orphan0, "not an sstable");
+		appendFile(stranger, "not an sstable");
+		if (!tables.empty())
+		{
+			std::ifstream in(level1 + tables.front(), std::ios::binary);
+			appendFile(orphan1, std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()));
+		}
+		{
+			Manifest m(path);
+			VersionEdit pending;
+			pending.pendingTable(0, orphan);
+			pending.pendingTable(1, orphan);
+			m.prepare(pending);
+		}
+		// 崩溃时写了一半的record
+		appendFile(manifestFile, std::string("\x12\x34\x64\x00\x00\x00" "partial", 13));
+		{
+			KVStore s(path, path + "/vlog");
+			EXPECT(false, fileExists(orphan0));
+			EXPECT(false, fileExists(orphan1));
+			EXPECT(true, fileExists(stranger));
+			check(s);
+		}
+		utils::rmfile(stranger);
+
+		/* 完整但校验和错误的record说明MANIFEST损坏，打开失败，不删除或改写任何文件
+		 * 无论错误的record在末尾还是在中间 */
+		size_t tableNum = countTables(path);
+		uint64_t manifestSize = fileSize(manifestFile);
+		appendFile(manifestFile, std::string("\x12\x34\x04\x00\x00\x00" "abcd", 10));
+		EXPECT(false, opens(path));
+		EXPECT(tableNum, countTables(path));
+		EXPECT(manifestSize + 10, fileSize(manifestFile));
+		EXPECT(0, truncate(manifestFile.c_str(), manifestSize));
+		flipByte(manifestFile, 20);
+		EXPECT(false, opens(path));
+		EXPECT(tableNum, countTables(path));
+		EXPECT(manifestSize, fileSize(manifestFile));
+		flipByte(manifestFile, 20);
+		{
+			KVStore s(path, path + "/vlog");
+			check(s);
+		}
+
+		// 没有MANIFEST时扫描目录
+		utils::rmfile(manifestFile);
+		{
+			KVStore s(path, path + "/vlog");
+			check(s);
+		}
+		EXPECT(true, fileExists(manifestFile));
+		{
+			KVStore s(path, path + "/vlog");
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	/* lazyIndex时index在第一次查找时读取：index缓存很小(频繁淘汰)或不缓存时，
+	 * 存在、已删除和不存在的key都能正确读取，lazyIndex打开后继续写入和合并也正确 */
+	void lazy_index_test(uint64_t max)
+	{
+		std::string path = storeDir("lazy");
+		auto check = [this, max](KVStore &s, uint64_t end)
+		{
+			for (uint64_t i = 0; i < end; i++)
+			{
+				EXPECT(i % 5 == 0 ? not_found : std::string(i % 50 + 1, i < max ? 'l' : 'm'), s.get(i));
+			}
+			for (uint64_t i = end; i < end + 1000; i++)
+			{
+				EXPECT(not_found, s.get(i));
+			}
+		};
+		{
+			KVStore s(path, path + "/vlog");
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'l'));
+			}
+			for (uint64_t i = 0; i < max; i += 5)
+			{
+				s.del(i);
+			}
+			s.waitForCompaction();
+		}
+		for (size_t indexCacheSize : {(size_t)4096, (size_t)0})
+		{
+			KVStoreOptions options;
+			options.lazyIndex = true;
+			options.indexCacheSize = indexCacheSize;
+			KVStore s(path, path + "/vlog", options);
+			check(s, max);
+		}
+		{
+			KVStoreOptions options;
+			options.lazyIndex = true;
+			options.indexCacheSize = 4096;
+			KVStore s(path, path + "/vlog", options);
+			for (uint64_t i = max; i < max * 2; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'm'));
+			}
+			for (uint64_t i = (max + 4) / 5 * 5; i < max * 2; i += 5)
+			{
+				s.del(i);
+			}
+			s.waitForCompaction();
+			check(s, max * 2);
+		}
+		{
+			KVStore s(path, path + "/vlog");
+			check(s, max * 2);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	/* 合并的边界情况：
+	 * 全部key都被删除时第一次合并没有输出，之后新建的下一层是空的
+	 * 崩溃前合并刚创建了更深一层的目录，重新打开时这一层是空的 */
+	void empty_level_test()
+	{
+		std::string path = storeDir("emptylevel");
+		// 不同的数量让删除标记落在不同的L0 SSTable中
+		for (uint64_t n : {400, 500, 800, 1000, 1600, 2000, 3000})
+		{
+			KVStore s(path, path + "/vlog");
+			s.reset();
+			for (uint64_t i = 0; i < n; i++)
+			{
+				s.put(i, std::string(i % 20 + 1, 'e'));
+			}
+			for (uint64_t i = 0; i < n; i++)
+			{
+				s.del(i);
+			}
+			s.waitForCompaction();
+			for (uint64_t i = 0; i < n; i++)
+			{
+				EXPECT(not_found, s.get(i));
+			}
+			for (uint64_t i = 0; i < n; i++)
+			{
+				s.put(i, std::string(i % 20 + 1, 'f'));
+			}
+			s.waitForCompaction();
+			for (uint64_t i = 0; i < n; i++)
+			{
+				EXPECT(std::string(i % 20 + 1, 'f'), s.get(i));
+			}
+		}
+
+		const uint64_t max = 1024 * 8;
+		{
+			KVStore s(path, path + "/vlog");
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'g'));
+			}
+			s.waitForCompaction();
+		}
+		int deepest = 0;
+		while (utils::dirExists(path + "/level-" + std::to_string(deepest + 1)))
+		{
+			deepest++;
+		}
+		utils::mkdir((path + "/level-" + std::to_string(deepest + 1)).c_str());
+		{
+			KVStore s(path, path + "/vlog");
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'h'));
+			}
+			s.waitForCompaction();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(std::string(i % 50 + 1, 'h'), s.get(i));
+			}
+		}
+		{
+			KVStore s(path, path + "/vlog");
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(std::string(i % 50 + 1, 'h'), s.get(i));
+			}
+			s.reset();
+		}
+
+		phase();
+	}
+
+	/* SSTable的文件描述符由容量很小的缓存管理时读取正确
+	 * 读取失败不能当作key不存在：MANIFEST中的SSTable缺失时打开失败，数据被截断时查找抛出异常 */
+	void file_cache_test(uint64_t max)
+	{
+		std::string path = storeDir("filecache");
+		KVStoreOptions options;
+		options.maxOpenFiles = 16;
+		options.blockCacheSize = 0;
+		options.valueCacheSize = 0;
+		auto check = [this, max](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(std::string(i % 50 + 1, 'c'), s.get(i));
+			}
+		};
+		{
+			KVStore s(path, path + "/vlog", options);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 50 + 1, 'c'));
+			}
+			s.waitForCompaction();
+			check(s);
+		}
+		{
+			KVStore s(path, path + "/vlog", options);
+			check(s);
+		}
+
+		std::string level1 = path + "/level-1/";
+		std::vector<std::string> tables;
+		utils::scanDir(level1, tables);
+		EXPECT(false, tables.empty());
+		if (!tables.empty())
+		{
+			std::string table = level1 + tables.front();
+			std::string saved = table + ".saved";
+			EXPECT(0, rename(table.c_str(), saved.c_str()));
+			EXPECT(false, opens(path));
+			EXPECT(0, rename(saved.c_str(), table.c_str()));
+
+			KVStore s(path, path + "/vlog", options);
+			uint64_t size = fileSize(table);
+			std::string data;
+			{
+				std::ifstream in(table, std::ios::binary);
+				data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			}
+			EXPECT(0, truncate(table.c_str(), sizeof(SSTable::Header)));
+			uint64_t failed = 0;
+			for (uint64_t i = 0; i < max; i++)
+			{
+				try
+				{
+					EXPECT(std::string(i % 50 + 1, 'c'), s.get(i));
+				}
+				catch (const std::runtime_error &)
+				{
+					failed++;
+				}
+			}
+			EXPECT(true, failed > 0);
+			std::ofstream(table, std::ios::binary | std::ios::trunc).write(data.data(), data.size());
+			EXPECT(size, fileSize(table));
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	// 读取文件中offset处的len字节，读不满时返回较短的内容
+	static std::string readFile(const std::string &path, uint64_t offset, size_t len)
+	{
+		std::ifstream in(path, std::ios::binary);
+		in.seekg(offset);
+		std::string buf(len, '\0');
+		in.read(&buf[0], len);
+		buf.resize(in.gcount());
+		return buf;
+	}
+
+	/* 检查vLog中offset处的entry：magic正确，header中保存完整的校验和，value是want */
+	void checkEntry(const std::string &vlog, uint64_t offset, uint8_t magic, const std::string &want)
+	{
+		std::string header = readFile(vlog, offset, MAXENTRYOFFSET);
+		EXPECT((size_t)MAXENTRYOFFSET, header.size());
+		EXPECT((int)magic, (int)(uint8_t)header[0]);
+		uint32_t checkSum, vlen;
+		uint64_t key;
+		size_t headerLen = vLogEntry::decodeHeader(header.data(), checkSum, key, vlen);
+		EXPECT(magic == MAGIC ? (size_t)ENTRYOFFSET : (size_t)ENTRYOFFSET_CRC32C, headerLen);
+		std::string v = readFile(vlog, offset + headerLen, vlen);
+		EXPECT(want, v);
+		EXPECT(vLogEntry::checksum(magic, key, vlen, v.data()), checkSum);
+	}
+
+	/* CRC16和CRC32C的entry混合在同一个vLog中：CRC32C的entry保存完整的32位校验和
+	 * 两种entry的header长度不同，读取、丢失超级块后的扫描和gc都要能正确解析 */
+	void vlog_checksum_test(uint64_t max)
+	{
+		std::string path = storeDir("vlogcrc");
+		std::string vlog = path + "/vlog";
+		auto valueOf = [max](uint64_t i)
+		{
+			return std::string(i % 100 + 1, i % 2 && i < max / 2 ? 'n' : 'o');
+		};
+		auto check = [this, max, &valueOf](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(valueOf(i), s.get(i));
+			}
+		};
+		KVStoreOptions options;
+		options.valueSeparationThreshold = 0;
+		options.gcGarbageRatio = 0;
+		options.vlogChecksum = ChecksumType::CRC16;
+		{
+			KVStore s(path, vlog, options);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, std::string(i % 100 + 1, 'o'));
+			}
+			s.waitForCompaction();
+		}
+		checkEntry(vlog, 0, MAGIC, std::string(1, 'o'));
+		uint64_t crc32cBegin = fileSize(vlog);
+		options.vlogChecksum = ChecksumType::CRC32C;
+		{
+			KVStore s(path, vlog, options);
+			for (uint64_t i = 1; i < max / 2; i += 2)
+			{
+				s.put(i, std::string(i % 100 + 1, 'n'));
+			}
+			s.waitForCompaction();
+			check(s);
+		}
+		checkEntry(vlog, crc32cBegin, MAGIC_CRC32C, std::string(2, 'n'));
+		// 超级块丢失时从头扫描，逐个按magic确定header的长度
+		utils::rmfile(vlog + ".super");
+		{
+			KVStore s(path, vlog, options);
+			check(s);
+			s.gc(crc32cBegin);
+			check(s);
+		}
+		// gc搬走了全部CRC16的entry，新的tail落在CRC32C的entry上
+		uint64_t tail = 0;
+		std::string super = readFile(vlog + ".super", 8, 8);
+		std::memcpy(&tail, super.data(), super.size());
+		EXPECT(true, tail >= crc32cBegin);
+		{
+			KVStore s(path, vlog, options);
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	static void writeAt(const std::string &path, uint64_t offset, const std::string &data)
+	{
+		std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+		f.seekp(offset);
+		f.write(data.data(), data.size());
+	}
+
+	// 重复度很高的value，LZ压缩后明显变小；每10个key有一个随机的value，压缩后不会变小
+	static std::string lzValue(uint64_t key, char tag)
+	{
+		std::string v;
+		if (key % 10 == 0)
+		{
+			uint64_t x = key * 6364136223846793005ull + tag;
+			for (size_t i = 0; i < 200; i++)
+			{
+				x = x * 6364136223846793005ull + 1442695040888963407ull;
+				v.push_back((char)(x >> 56));
+			}
+			return v;
+		}
+		for (uint64_t k = 0; k < key % 20 + 5; k++)
+		{
+			v += "{\"id\":" + std::to_string(key * 31 + k) + ",\"tag\":\"" + tag + "\",\"active\":true},";
+		}
+		return v;
+	}
+
+	/* LZCodec本身：各种输入压缩后能还原
+	 * 截断的数据、长度不符的rawLen、指向输出之前的匹配距离都要返回false，不能越界 */
+	void lz_codec_test()
+	{
+		std::vector<std::string> inputs = {"", "a", "abcd", std::string(1000, 'x'), lzValue(7, 'c'), lzValue(10, 'c')};
+		std::string mixed;
+		for (int i = 0; i < 300; i++)
+		{
+			mixed += lzValue(i, 'm');
+		}
+		inputs.push_back(mixed);
+		for (const std::string &raw : inputs)
+		{
+			std::string c;
+			LZCodec::compress(raw.data(), raw.size(), c);
+			std::string back(raw.size(), '\0');
+			EXPECT(true, LZCodec::decompress(c.data(), c.size(), &back[0], raw.size()));
+			EXPECT(raw, back);
+			if (raw.empty())
+			{
+				continue;
+			}
+			// 多出一个字节的输出空间或者少一个字节都不行
+			std::string longer(raw.size() + 1, '\0');
+			EXPECT(false, LZCodec::decompress(c.data(), c.size(), &longer[0], raw.size() + 1));
+			EXPECT(false, LZCodec::decompress(c.data(), c.size(), &back[0], raw.size() - 1));
+			for (size_t len = 0; len < c.size(); len++)
+			{
+				EXPECT(false, LZCodec::decompress(c.data(), len, &back[0], raw.size()));
+			}
+		}
+		// token要求匹配4个字节，距离1指向第一个字节之前
+		const char badDistance[] = {0x00, 0x01, 0x00};
+		std::string out(4, '\0');
+		EXPECT(false, LZCodec::decompress(badDistance, sizeof(badDistance), &out[0], out.size()));
+		// 字面量长度15之后缺少扩展长度
+		const char badLength[] = {(char)0xf0};
+		EXPECT(false, LZCodec::decompress(badLength, sizeof(badLength), &out[0], out.size()));
+
+		phase();
+	}
+
+	/* 压缩和不压缩的entry混合在同一个vLog中，切换设置重新打开、gc之后都能正确读取
+	 * entry中记录的原始长度被改大或改小时读取失败，不会返回错误的value */
+	void lz_store_test(uint64_t max)
+	{
+		std::string path = storeDir("lz");
+		std::string vlog = path + "/vlog";
+		auto valueOf = [](uint64_t i)
+		{
+			return lzValue(i, i % 3 == 0 ? 'b' : 'a');
+		};
+		auto check = [this, max, &valueOf](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(valueOf(i), s.get(i));
+			}
+		};
+		KVStoreOptions lz;
+		lz.vlogCompression = CompressionType::LZ;
+		lz.gcGarbageRatio = 0;
+		lz.valueCacheSize = 0;
+		KVStoreOptions plain = lz;
+		plain.vlogCompression = CompressionType::NONE;
+		uint64_t rawSize = 0;
+		{
+			KVStore s(path, vlog, lz);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, lzValue(i, 'a'));
+				rawSize += lzValue(i, 'a').size();
+			}
+			s.waitForCompaction();
+		}
+		EXPECT(true, fileSize(vlog) < rawSize / 2);
+		// 第一个entry是key 0，随机的value不压缩；第二个entry是key 1，压缩
+		std::string first = readFile(vlog, 0, ENTRYOFFSET_CRC32C);
+		EXPECT((int)MAGIC_CRC32C, (int)(uint8_t)first[0]);
+		uint64_t second = ENTRYOFFSET_CRC32C + lzValue(0, 'a').size() + 1;
+		EXPECT((int)(MAGIC_CRC32C & ~MAGIC_LZ), (int)(uint8_t)readFile(vlog, second, 1)[0]);
+		{
+			KVStore s(path, vlog, plain);
+			for (uint64_t i = 0; i < max; i += 3)
+			{
+				s.put(i, lzValue(i, 'b'));
+			}
+			s.waitForCompaction();
+			check(s);
+		}
+		{
+			KVStore s(path, vlog, lz);
+			check(s);
+			s.gc(fileSize(vlog));
+			check(s);
+		}
+		{
+			KVStore s(path, vlog, plain);
+			check(s);
+		}
+
+		// 改写key 1的entry中value前面的原始长度
+		{
+			KVStore s(path, vlog, lz);
+			s.reset();
+			for (uint64_t i = 0; i < 10; i++)
+			{
+				s.put(i, lzValue(i, 'a'));
+			}
+		}
+		uint32_t rawLen = lzValue(1, 'a').size();
+		second = ENTRYOFFSET_CRC32C + lzValue(0, 'a').size() + 1;
+		for (uint32_t badLen : {rawLen + 1, rawLen - 1, rawLen})
+		{
+			writeAt(vlog, second + ENTRYOFFSET_CRC32C, std::string((const char *)&badLen, sizeof(badLen)));
+			KVStore s(path, vlog, lz);
+			EXPECT(badLen == rawLen ? lzValue(1, 'a') : std::string(), s.get(1));
+			EXPECT(lzValue(2, 'a'), s.get(2));
+		}
+		{
+			KVStore s(path, vlog, lz);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	// 文件实际占用的磁盘空间，gc打出的空洞不计入
+	static uint64_t diskBytes(const std::string &path)
+	{
+		struct stat st;
+		return stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+	}
+
+	/* 前一半的key覆盖两次，合并后最早的segment全部失效
+	 * gcSegments回收之后vLog占用的磁盘空间减少，重新打开后所有value仍然正确 */
+	void gc_segments_test(uint64_t max)
+	{
+		std::string path = storeDir("gcseg");
+		std::string vlog = path + "/vlog";
+		auto valueOf = [max](uint64_t i, int round)
+		{
+			return std::string(4000, 'a' + (i + round) % 26);
+		};
+		auto check = [this, max, &valueOf](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(valueOf(i, i < max / 2 ? 2 : 0), s.get(i));
+			}
+		};
+		KVStoreOptions options;
+		options.gcGarbageRatio = 0;
+		uint64_t before;
+		{
+			KVStore s(path, vlog, options);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, valueOf(i, 0));
+			}
+			for (int round = 1; round <= 2; round++)
+			{
+				for (uint64_t i = 0; i < max / 2; i++)
+				{
+					s.put(i, valueOf(i, round));
+				}
+			}
+			s.waitForCompaction();
+			before = diskBytes(vlog);
+			s.gcSegments(SEGMENTSIZE);
+			check(s);
+		}
+		uint64_t after = diskBytes(vlog);
+		EXPECT(true, after + SEGMENTSIZE / 2 <= before);
+		{
+			KVStore s(path, vlog, options);
+			check(s);
+			EXPECT(after, diskBytes(vlog));
+			s.reset();
+		}
+
+		phase();
+	}
+
+	/* 后台gc：失效数据超过gcGarbageRatio后自动回收segment
+	 * 限速很低时后台gc在等待中持有segment，前台的gcSegments不会被它阻塞到整个segment搬完 */
+	void gc_background_test(uint64_t max)
+	{
+		std::string path = storeDir("gcbg");
+		std::string vlog = path + "/vlog";
+		auto valueOf = [](uint64_t i, int round)
+		{
+			return std::string(4000, 'A' + (i + round) % 26);
+		};
+		auto check = [this, max, &valueOf](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(valueOf(i, i < max / 2 ? 2 : 0), s.get(i));
+			}
+		};
+		auto fill = [max, &valueOf](KVStore &s)
+		{
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, valueOf(i, 0));
+			}
+			for (int round = 1; round <= 2; round++)
+			{
+				for (uint64_t i = 0; i < max / 2; i++)
+				{
+					s.put(i, valueOf(i, round));
+				}
+			}
+			s.waitForCompaction();
+		};
+		KVStoreOptions options;
+		options.gcGarbageRatio = 0.2;
+		uint64_t before;
+		{
+			KVStore s(path, vlog, options);
+			fill(s);
+			before = diskBytes(vlog);
+			// 等待后台gc回收最早的segment
+			for (int i = 0; i < 100 && diskBytes(vlog) + SEGMENTSIZE / 2 > before; i++)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+			EXPECT(true, diskBytes(vlog) + SEGMENTSIZE / 2 <= before);
+			check(s);
+		}
+		{
+			KVStore s(path, vlog, options);
+			check(s);
+		}
+
+		// 每秒只扫描256KB，后台gc搬完一个segment需要一分钟
+		options.gcRateLimit = 256 * 1024;
+		{
+			KVStore s(path, vlog, options);
+			fill(s);
+			before = diskBytes(vlog);
+			// 后台gc每100ms检查一次，等它开始搬运并进入限速等待
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+			auto start = std::chrono::steady_clock::now();
+			s.gcSegments(SEGMENTSIZE);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			EXPECT(true, elapsed < std::chrono::seconds(10));
+			EXPECT(true, diskBytes(vlog) + SEGMENTSIZE / 2 <= before);
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	// 超级块的校验和正确
+	static bool superValid(const std::string &path)
+	{
+		std::string buf = readFile(path, 0, 1 << 20);
+		uint32_t checkSum;
+		if (buf.size() < 24)
+		{
+			return false;
+		}
+		std::memcpy(&checkSum, buf.data() + buf.size() - 4, 4);
+		return utils::crc32c(0, buf.data(), buf.size() - 4) == checkSum;
+	}
+
+	/* vLog的超级块缺失、损坏、被截断或者留下了写了一半的临时文件时，启动时扫描vLog重建segment
+	 * 重建后写出新的超级块，已经回收的segment仍是空洞，所有value正确，gc可以继续进行 */
+	void superblock_test(uint64_t max)
+	{
+		std::string path = storeDir("super");
+		std::string vlog = path + "/vlog";
+		std::string super = vlog + ".super";
+		auto valueOf = [](uint64_t i, int round)
+		{
+			return std::string(4000, 'a' + (i * 7 + round) % 26);
+		};
+		auto check = [this, max, &valueOf](KVStore &s)
+		{
+			for (uint64_t i = 0; i < max; i++)
+			{
+				EXPECT(valueOf(i, i < max / 2 ? 2 : 0), s.get(i));
+			}
+		};
+		KVStoreOptions options;
+		options.gcGarbageRatio = 0;
+		options.valueCacheSize = 0;
+		{
+			KVStore s(path, vlog, options);
+			s.reset();
+			for (uint64_t i = 0; i < max; i++)
+			{
+				s.put(i, valueOf(i, 0));
+			}
+			for (int round = 1; round <= 2; round++)
+			{
+				for (uint64_t i = 0; i < max / 2; i++)
+				{
+					s.put(i, valueOf(i, round));
+				}
+			}
+			s.waitForCompaction();
+			s.gcSegments(SEGMENTSIZE);
+		}
+		EXPECT(true, superValid(super));
+		uint64_t used = diskBytes(vlog);
+
+		std::vector<std::function<void()>> damages = {
+			[&]()
+			{ utils::rmfile(super); },
+			[&]()
+			{ flipByte(super, 8); },
+			[&]()
+			{ truncate(super.c_str(), 10); },
+			[&]()
+			{ utils::rmfile(super); appendFile(super + ".tmp", "half written"); },
+		};
+		for (const auto &damage : damages)
+		{
+			damage();
+			{
+				KVStore s(path, vlog, options);
+				check(s);
+			}
+			EXPECT(true, superValid(super));
+			EXPECT(false, fileExists(super + ".tmp"));
+			EXPECT(used, diskBytes(vlog));
+		}
+		{
+			KVStore s(path, vlog, options);
+			s.gc(fileSize(vlog));
+			check(s);
+		}
+		{
+			KVStore s(path, vlog, options);
+			check(s);
+			s.reset();
+		}
+
+		phase();
+	}
+
+	/* ValueCache按offset的范围失效：只删除范围内的项，占用的大小随之减少，范围外的项仍然命中 */
+	void value_cache_test()
+	{
+		ValueCache cache(16 * 1024 * 1024);
+		const uint64_t n = 10000;
+		for (uint64_t i = 0; i < n; i++)
+		{
+			cache.insert(i * 100, std::string(10, 'a' + i % 26));
+		}
+		EXPECT((size_t)n * 10, cache.getStats().usage);
+		// 范围的两端不在任何一项上
+		cache.eraseRange(2050, 5050);
+		cache.eraseRange(9000 * 100, 9000 * 100);
+		std::string v;
+		for (uint64_t i = 0; i < n; i++)
+		{
+			bool erased = i * 100 >= 2050 && i * 100 < 5050;
+			EXPECT(!erased, cache.lookup(i * 100, v));
+			if (!erased)
+			{
+				EXPECT(std::string(10, 'a' + i % 26), v);
+			}
+		}
+		EXPECT((size_t)(n - 30) * 10, cache.getStats().usage);
+		cache.eraseRange(0, UINT64_MAX);
+		EXPECT((size_t)0, cache.getStats().usage);
+		EXPECT(false, cache.lookup(n * 100 - 100, v));
+
+		phase();
+	}
+
+public:
+	FeatureTest(const std::string &dir, const std::string &vlog, bool v = true) : Test(dir, vlog, v), dir(dir)
+	{
+	}
+
+	void start_test(void *args = NULL)
+	{
+		unsigned threadNum = std::max(4u, std::thread::hardware_concurrency());
+
+		std::cout << "Concurrent MemTable Insert Test" << std::endl;
+		memtable_test(threadNum, 1024 * 64);
+		concurrent_put_test(threadNum, 1024 * 16);
+
+		std::cout << "WriteBatch Test" << std::endl;
+		write_batch_test(200);
+		write_batch_crash_test(200);
+
+		std::cout << "XOR8 Filter Test" << std::endl;
+		xor_filter_test();
+		xor_store_test(1024 * 16);
+
+		std::cout << "MANIFEST Recovery Test" << std::endl;
+		manifest_test(1024 * 16);
+
+		std::cout << "Lazy Index Test" << std::endl;
+		lazy_index_test(1024 * 16);
+
+		std::cout << "SSTable File Cache Test" << std::endl;
+		file_cache_test(1024 * 16);
+
+		std::cout << "Compaction Edge Case Test" << std::endl;
+		empty_level_test();
+
+		std::cout << "vLog Checksum Test" << std::endl;
+		vlog_checksum_test(1024 * 16);
+
+		std::cout << "LZ Compression Test" << std::endl;
+		lz_codec_test();
+		lz_store_test(1024 * 8);
+
+		std::cout << "vLog Segment GC Test" << std::endl;
+		gc_segments_test(1024 * 8);
+		gc_background_test(1024 * 8);
+
+		std::cout << "vLog Superblock Recovery Test" << std::endl;
+		superblock_test(1024 * 8);
+
+		std::cout << "Value Cache Test" << std::endl;
+		value_cache_test();
+
+		report();
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	bool verbose = (argc == 2 && std::string(argv[1]) == "-v");
+
+	std::cout << "Usage: " << argv[0] << " [-v]" << std::endl;
+	std::cout << "  -v: print extra info for failed tests [currently ";
+	std::cout << (verbose ? "ON" : "OFF") << "]" << std::endl;
+	std::cout << std::endl;
+	std::cout.flush();
+
+	FeatureTest test("./data", "./data/vlog", verbose);
+
+	test.start_test();
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <sys/stat.h>
+
+#include "kvstore.h"
+#include "utils.h"
+
+#define MB (1024 * 1024)
+
+/* vLog gc吞吐量测试：写入数据并覆盖其中一部分，统计gc每秒回收的字节数
+ * 关闭后台gc，避免和被测的gc同时运行 */
+class GCBench
+{
+private:
+    const uint64_t KEY_NUM = 1024 * 16;
+    const size_t VALUE_SIZE = 4096;
+    const uint64_t CHUNK_SIZE = 8 * MB;
+
+    const std::string vlog;
+    KVStore store;
+
+    static KVStoreOptions benchOptions()
+    {
+        KVStoreOptions options;
+        options.gcGarbageRatio = 0;
+        return options;
+    }
+
+    // vLog实际占用的磁盘空间
+    uint64_t allocatedBytes()
+    {
+        struct stat st;
+        if (stat(vlog.c_str(), &st) != 0)
+        {
+            return 0;
+        }
+        return (uint64_t)st.st_blocks * 512;
+    }
+
+    /* 写入KEY_NUM个key，然后覆盖其中deadPercent%的key
+     * 旧版本在合并时才被计为失效，所以最后等待后台合并全部完成 */
+    void prepare(int deadPercent)
+    {
+        store.reset();
+        for (uint64_t i = 0; i < KEY_NUM; i++)
+        {
+            store.put(i, std::string(VALUE_SIZE, 'a' + i % 26));
+        }
+        for (uint64_t i = 0; i < KEY_NUM; i++)
+        {
+            if ((int)(i % 100) < deadPercent)
+            {
+                store.put(i, std::string(VALUE_SIZE, 'A' + i % 26));
+            }
+        }
+        store.waitForCompaction();
+    }
+
+    void report(const char *name, int deadPercent, uint64_t bytes, double seconds)
+    {
+        std::cout << name << "\tdead: " << deadPercent << "%\treclaimed: " << bytes / MB << "MB\t"
+                  << "time: " << seconds << "s\t"
+                  << "throughput: " << bytes / MB / seconds << " MB/s\n";
+    }
+
+    // 从tail开始回收第一轮写入的全部数据
+    void tail_gc_test(int deadPercent)
+    {
+        prepare(deadPercent);
+        uint64_t target = KEY_NUM * VALUE_SIZE;
+        uint64_t begin = utils::seek_data_block(vlog.c_str());
+        uint64_t cur = begin;
+        auto t1 = std::chrono::steady_clock::now();
+        while (cur - begin < target)
+        {
+            store.gc(CHUNK_SIZE);
+            uint64_t next = utils::seek_data_block(vlog.c_str());
+            if (next == cur)
+            {
+                break;
+            }
+            cur = next;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        report("gc", deadPercent, cur - begin, std::chrono::duration<double>(t2 - t1).count());
+    }
+
+    // 按segment回收失效数据最多的部分
+    void segment_gc_test(int deadPercent)
+    {
+        prepare(deadPercent);
+        uint64_t before = allocatedBytes();
+        auto t1 = std::chrono::steady_clock::now();
+        store.gcSegments(KEY_NUM * VALUE_SIZE);
+        auto t2 = std::chrono::steady_clock::now();
+        uint64_t after = allocatedBytes();
+        report("gcSegments", deadPercent, before > after ? before - after : 0,
+               std::chrono::duration<double>(t2 - t1).count());
+    }
+
+public:
+    GCBench(const std::string &dir, const std::string &vlog) : vlog(vlog), store(dir, vlog, benchOptions())
+    {
+    }
+
+    void start_test()
+    {
+        std::cout << "KVStore vLog GC Throughput Test" << std::endl;
+        for (int deadPercent : {100, 50, 10})
+        {
+            tail_gc_test(deadPercent);
+        }
+        for (int deadPercent : {100, 50, 10})
+        {
+            segment_gc_test(deadPercent);
+        }
+        store.reset();
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    std::cout << "Usage: " << argv[0] << std::endl
+              << std::endl;
+    std::cout.flush();
+
+    GCBench test("./data", "./data/vlog");
+
+    test.start_test();
+
+    return 0;
+}
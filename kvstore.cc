@@ -1,64 +1,269 @@
 #include "kvstore.h"
 #include <string>
+#include <algorithm>
+#include <stdexcept>
 
 /* 最大内存尺寸为16kB */
 #define MAXMEMSIZE 16384
-#define INITSIZE 8224
+/* 最多允许的immTable数量，超过后写入需要等待落盘 */
+#define MAXIMMNUM 4
 /* size of Key(8) & Offset(8) & Vlen(4) */
 #define KOVSIZE 20
 #define DELETEFLAG "~DELETED~"
+/* gc每一批扫描的vLog字节数 */
+#define GCBATCHSIZE (1024 * 1024)
+/* 后台gc检查失效比例的间隔(ms) */
+#define GCINTERVAL 100
+/* 第0层的SSTable达到这个数量时落盘需要等待后台合并 */
+#define L0STOPFILES 8
 
 /* 启动时，检查现有目录的各层SSTable文件，在内存中构建相应缓存，同时恢复tail和head的值。即启动时需要读取以前的SSTable数据和vLog文件 */
-KVStore::KVStore(const std::string &dir, const std::string &vlogN) : KVStoreAPI(dir, vlogN)
+KVStore::KVStore(const std::string &dir, const std::string &vlogN, const KVStoreOptions &options) : KVStoreAPI(dir, vlogN)
 {
 	this->sstDir = dir;
 	this->vlogFileName = vlogN;
-	this->memSize = 0;
-	ssList = new SSList();
-	vlog = new vLog(vlogFileName);
+	this->inlineThreshold = options.valueSeparationThreshold;
+	this->filterPolicy.bitsPerKey = options.bloomBitsPerKey;
+	this->levelFilterTypes = options.levelFilterTypes;
+	this->memTable = std::make_shared<MemTable>(inlineThreshold);
+	this->stopFlush = false;
+	this->stopGC = false;
+	this->gcWaiters = 0;
+	this->stopCompact = false;
+	this->compactPending = true; // 启动时检查一次上次遗留的需要合并的层
+	this->gcRatio = options.gcGarbageRatio;
+	this->gcRate = options.gcRateLimit;
+	this->wal = nullptr;
+	this->openThreads = std::max<uint32_t>(options.openThreads, 1);
+	ssList = new SSList(options.blockCacheSize, options.lazyIndex, options.indexCacheSize, options.maxOpenFiles);
+	vlog = new vLog(vlogFileName, options.vlogMmap, options.vlogChecksum, options.vlogCompression);
 	buffer = new CompactBuffer();
+	valueCache = options.valueCacheSize > 0 ? new ValueCache(options.valueCacheSize) : nullptr;
 	maxTime = 1;
-	int level;
-	std::string pathname;
-	// 读取磁盘中已经有了的SSTable
-	for (level = 0, pathname = generateLevelName(level); utils::dirExists(pathname); pathname = generateLevelName(++level))
+	if (!utils::dirExists(sstDir))
 	{
-		level_file_num.push_back(0); // 当前层SSTable初始为0
-		std::vector<std::string> ret;
-		ret.clear();
-		int k = 0;
-		utils::scanDir(pathname, ret);
+		utils::mkdir(sstDir);
+	}
+	manifest = new Manifest(sstDir);
+	try
+	{
+		loadTables();
+	}
+	catch (...)
+	{
+		delete manifest;
+		delete valueCache;
+		delete buffer;
+		delete vlog;
+		delete ssList;
+		throw;
+	}
+	compactThread = std::thread(&KVStore::compactLoop, this);
+	flushThread = std::thread(&KVStore::flushLoop, this);
+	if (options.useWAL)
+	{
+		recoverWAL(options);
+	}
+	if (gcRatio > 0)
+	{
+		gcThread = std::thread(&KVStore::gcLoop, this);
+	}
+}
 
-		for (std::vector<std::string>::iterator it = ret.begin(); it != ret.end(); it++)
+void KVStore::loadTables()
+{
+	// 已经存在的层目录，只检查是否存在，不列出目录内容
+	for (int level = 0; utils::dirExists(generateLevelName(level)); level++)
+	{
+		level_file_num.push_back(0);
+	}
+	std::vector<std::vector<TableMeta>> levels;
+	std::set<std::pair<int, std::string>> garbage;
+	Manifest::RecoverStatus status = manifest->recover(levels, garbage);
+	if (status == Manifest::CORRUPTED)
+	{
+		// 不能确定哪些SSTable有效，不删除也不改写任何文件，由用户处理(删除MANIFEST后会扫描目录重建)
+		throw std::runtime_error("MANIFEST in " + sstDir + " is corrupted");
+	}
+	bool fromManifest = status == Manifest::RECOVERED;
+	if (!fromManifest)
+	{
+		// 没有MANIFEST的旧数据，扫描一次目录，之后写成MANIFEST
+		for (size_t level = 0; level < level_file_num.size(); level++)
 		{
-			std::fstream *input = new std::fstream((pathname + *it).c_str(), std::ios::binary | std::ios::in);
-			if (!input->is_open())
+			levels.push_back(std::vector<TableMeta>());
+			std::vector<std::string> ret;
+			utils::scanDir(generateLevelName(level), ret);
+			for (const std::string &f : ret)
 			{
-				input->close();
-				delete input;
-				break;
+				levels[level].push_back(TableMeta{(int)level, f, 0, 0, 0, 0, 0});
 			}
-			level_file_num[level]++; // 打开成功，这一层的文件数量增加
-			// 读取对应位置的SSTable
-			SSTable *t = ssList->readSSTable(level, k, input);
-			if (t->getTime() >= maxTime)
+		}
+	}
+	// 读取磁盘中已经有了的SSTable，由openThreads个线程并行读取，每个线程每次取下一个文件
+	struct Task
+	{
+		const TableMeta *meta;
+		std::string path;
+		SSTable *table;
+		uint64_t fileSize;
+	};
+	std::vector<Task> tasks;
+	for (size_t level = 0; level < levels.size(); level++)
+	{
+		createDirByLevel(level);
+		for (const TableMeta &m : levels[level])
+		{
+			tasks.push_back(Task{&m, generateLevelName(level) + m.fileName, nullptr, 0});
+		}
+	}
+	std::atomic<size_t> next{0};
+	auto work = [this, &tasks, &next]()
+	{
+		for (size_t i; (i = next.fetch_add(1)) < tasks.size();)
+		{
+			Task &task = tasks[i];
+			std::fstream input(task.path.c_str(), std::ios::binary | std::ios::in);
+			if (!input.is_open())
 			{
-				maxTime = t->getTime() + 1; // 更新最大时间戳
+				continue;
 			}
-			k++;
-			input->close();
-			delete input;
+			task.table = ssList->loadSSTable(task.meta->level, 0, &input, task.path);
+			input.clear();
+			input.seekg(0, std::ios::end);
+			task.fileSize = input.tellg();
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < std::min<size_t>(openThreads, tasks.size()); i++)
+	{
+		workers.emplace_back(work);
+	}
+	work();
+	for (std::thread &w : workers)
+	{
+		w.join();
+	}
+
+	// 有SSTable读取失败时打开失败，不能把它从MANIFEST中去掉，否则下次打开时会被当作无用的文件
+	for (Task &task : tasks)
+	{
+		if (!task.table)
+		{
+			for (Task &t : tasks)
+			{
+				delete t.table;
+			}
+			throw std::runtime_error("Failed to load SSTable " + task.path);
+		}
+	}
+
+	// 按原来的顺序加入ssList
+	std::vector<std::vector<TableMeta>> loaded(levels.size());
+	for (Task &task : tasks)
+	{
+		int level = task.meta->level;
+		SSTable *t = task.table;
+		t->changeId(level_file_num[level]);
+		ssList->addToList(level, level_file_num[level], t, false);
+		level_file_num[level]++; // 打开成功，这一层的文件数量增加
+		if (t->getTime() >= maxTime)
+		{
+			maxTime = t->getTime() + 1; // 更新最大时间戳
+		}
+		loaded[level].push_back(fromManifest ? *task.meta : tableMeta(level, task.path, t, task.fileSize));
+	}
+	// 全部加入之后每层只建一次有序视图，没有SSTable的层(例如崩溃前刚创建的目录)也要有
+	ssList->addLevels(level_file_num.size());
+	for (size_t level = 0; level < ssList->tables.size(); level++)
+	{
+		ssList->rebuildFences(level);
+	}
+
+	/* 落盘或合并在记录到MANIFEST之前崩溃时，写出的SSTable(PENDING之后没有ADD)不属于任何版本
+	 * 合并在提交之后、删除输入文件之前崩溃时，输入文件也留在磁盘上，这些文件都记录在garbage中，不需要扫描目录
+	 * 在rewrite之前删除，rewrite之后MANIFEST中不再有这些记录 */
+	std::set<std::pair<int, std::string>> live;
+	for (const std::vector<TableMeta> &l : levels)
+	{
+		for (const TableMeta &m : l)
+		{
+			live.emplace(m.level, m.fileName);
 		}
 	}
+	for (const std::pair<int, std::string> &g : garbage)
+	{
+		if (!live.count(g))
+		{
+			utils::rmfile(generateLevelName(g.first) + g.second);
+		}
+	}
+	manifest->rewrite(loaded);
+}
+
+TableMeta KVStore::tableMeta(int level, const std::string &path, const SSTable *t, uint64_t fileSize)
+{
+	return TableMeta{level, path.substr(path.rfind('/') + 1), t->minK(), t->maxK(), t->getTime(), t->size(), fileSize};
+}
+
+void KVStore::recoverWAL(const KVStoreOptions &options)
+{
+	if (!utils::dirExists(sstDir))
+	{
+		utils::mkdir(sstDir);
+	}
+	WAL *w = new WAL(sstDir, options.walSyncMode, options.walSyncInterval);
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	w->recover([this, &lock](uint8_t type, uint64_t key, std::string &&value)
+			   {
+		makeRoomForWrite(lock, false);
+		memTable->put(key, type == WriteBatch::DEL ? DELETEFLAG : value); });
+	// 回放的数据全部落盘后，旧的log就可以删除了
+	waitForFlush(lock);
+	w->removeRecovered();
+	wal = w;
 }
 
 KVStore::~KVStore()
 {
+	{
+		std::lock_guard<std::mutex> lock(gcStateMutex);
+		stopGC = true;
+		gcCv.notify_all();
+	}
+	if (gcThread.joinable())
+	{
+		gcThread.join();
+	}
 	// 系统正常关闭，应该将MemTable的数据写入SSTable和vLog
-	saveMem();
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		makeRoomForWrite(lock, true);
+		stopFlush = true;
+		flushCv.notify_all();
+	}
+	flushThread.join();
+	// 落盘线程可能在等待合并，所以最后停止合并线程
+	{
+		std::lock_guard<std::mutex> lock(compactStateMutex);
+		stopCompact = true;
+		compactCv.notify_all();
+	}
+	compactThread.join();
+	delete wal;
+	delete manifest;
 	delete ssList;
 	delete vlog;
 	delete buffer;
+	delete valueCache;
+}
+
+/* 再放入一个key后落盘得到的SSTable会超过MAXMEMSIZE时memTable已满，大小按encodeTable的格式计算
+ * 过滤器的大小由第0层的过滤器类型和key的数量决定 */
+static bool memFull(const MemTable &mem, const FilterPolicy &policy)
+{
+	size_t dataSize = (mem.size() + 1) * KOVSIZE + mem.inlineSize();
+	return SSTable::encodedSize(dataSize, dataSize / SSTable::BLOCKSIZE + 1, mem.size() + 1, policy) > MAXMEMSIZE;
 }
 
 /**
@@ -67,32 +272,202 @@ KVStore::~KVStore()
  */
 void KVStore::put(uint64_t key, const std::string &s)
 {
-	uint64_t tmpSize = memSize * KOVSIZE + INITSIZE;
-	if (tmpSize >= MAXMEMSIZE)
+	if (!wal)
 	{
-		saveMem(); // 内存中如果即将添加后满了，就要保存到磁盘 SSTable第0层
-		if (level_file_num[0] > 2)
+		std::shared_lock<std::shared_mutex> lock = lockForWrite();
+		memTable->put(key, s);
+		return;
+	}
+	WriteBatch batch;
+	batch.put(key, s);
+	if (!write(batch))
+	{
+		std::cerr << "Error: Failed to write WAL, put of key " << key << " is dropped." << std::endl;
+	}
+}
+
+bool KVStore::write(const WriteBatch &batch)
+{
+	if (batch.empty())
+	{
+		return true;
+	}
+	if (!wal)
+	{
+		std::shared_lock<std::shared_mutex> lock = lockForWrite();
+		applyBatch(batch);
+		return true;
+	}
+
+	// 排队，等待前面的线程把自己的写入一起提交，或者自己成为队首
+	Writer w(&batch);
+	std::unique_lock<std::mutex> writeLock(writeMutex);
+	writers.push_back(&w);
+	w.cv.wait(writeLock, [this, &w]()
+			  { return w.done || writers.front() == &w; });
+	if (w.done)
+	{
+		return w.ok;
+	}
+
+	// 队首线程把队列中所有的batch合并成一条record
+	WriteBatch merged;
+	const WriteBatch *toWrite = &batch;
+	std::vector<Writer *> group(writers.begin(), writers.end());
+	if (group.size() > 1)
+	{
+		for (Writer *x : group)
+		{
+			merged.append(*x->batch);
+		}
+		toWrite = &merged;
+	}
+	writeLock.unlock();
+	bool ok;
+	{
+		std::shared_lock<std::shared_mutex> lock = lockForWrite();
+		// 没有写入WAL的batch不能生效，否则崩溃后无法恢复
+		ok = wal->append(toWrite->data());
+		if (ok)
+		{
+			applyBatch(*toWrite);
+		}
+	}
+	writeLock.lock();
+	for (Writer *x : group)
+	{
+		writers.pop_front();
+		if (x != &w)
 		{
-			compact(0);
+			x->ok = ok;
+			x->done = true;
+			x->cv.notify_one();
 		}
 	}
-	memTable.put(key, s) ? ++memSize : memSize; // 放入新的key，注意如果成功保存到磁盘了，这是的内存就是新的
+	// 唤醒新的队首
+	if (!writers.empty())
+	{
+		writers.front()->cv.notify_one();
+	}
+	return ok;
+}
+
+void KVStore::applyBatch(const WriteBatch &batch)
+{
+	batch.iterate([this](uint8_t type, uint64_t key, std::string &&value)
+				  { memTable->put(key, type == WriteBatch::DEL ? DELETEFLAG : value); });
 }
+
+std::shared_lock<std::shared_mutex> KVStore::lockForWrite()
+{
+	while (true)
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		if (!memFull(*memTable, filterPolicyFor(0)))
+		{
+			return lock;
+		}
+		lock.unlock();
+		// 内存中如果即将添加后满了，就转为immTable交给后台线程保存到磁盘
+		std::unique_lock<std::shared_mutex> uniqueLock(mutex);
+		makeRoomForWrite(uniqueLock, false);
+	}
+}
+
+void KVStore::makeRoomForWrite(std::unique_lock<std::shared_mutex> &lock, bool force)
+{
+	while (force ? !memTable->empty() : memFull(*memTable, filterPolicyFor(0)))
+	{
+		if (immTables.size() >= MAXIMMNUM)
+		{
+			// 后台落盘跟不上，等待
+			flushDone.wait(lock);
+			continue;
+		}
+		immTables.push_back(memTable);
+		memTable = std::make_shared<MemTable>(inlineThreshold);
+		if (wal)
+		{
+			wal->rotate(); // 新的memTable写入新的log
+		}
+		flushCv.notify_one();
+		break;
+	}
+}
+
+void KVStore::waitForFlush(std::unique_lock<std::shared_mutex> &lock)
+{
+	makeRoomForWrite(lock, true);
+	flushDone.wait(lock, [this]()
+				   { return immTables.empty(); });
+}
+
+void KVStore::flushLoop()
+{
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	while (true)
+	{
+		flushCv.wait(lock, [this]()
+					 { return stopFlush || !immTables.empty(); });
+		if (immTables.empty())
+		{
+			return; // stopFlush且已经全部落盘
+		}
+		std::shared_ptr<MemTable> imm = immTables.front();
+		lock.unlock();
+		{
+			std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+			// 第0层堆积太多时等待后台合并，否则查找要检查的SSTable会越来越多
+			compactDone.wait(diskLock, [this]()
+							 { return level_file_num.empty() || level_file_num[0] < L0STOPFILES; });
+			saveMem(*imm); // 保存到磁盘 SSTable第0层
+		}
+		scheduleCompaction();
+		lock.lock();
+		// 写入磁盘之后才能从immTables中移除，保证get总能找到数据
+		immTables.pop_front();
+		if (wal)
+		{
+			wal->releaseOldest();
+		}
+		flushDone.notify_all();
+	}
+}
+
+bool KVStore::searchInMem(uint64_t key, std::string &value)
+{
+	value = memTable->get(key);
+	if (value != "")
+	{
+		return true;
+	}
+	for (auto it = immTables.rbegin(); it != immTables.rend(); ++it)
+	{
+		value = (*it)->get(key);
+		if (value != "")
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 /**
  * Returns the (string) value of the given key.
  * An empty string indicates not found.
  */
 std::string KVStore::get(uint64_t key)
 {
-	std::string tmpV = memTable.get(key);
-	if (tmpV != "" && tmpV != DELETEFLAG)
-	{
-		return tmpV; // 在内存中找到，直接返回
-	}
-	if (tmpV == DELETEFLAG)
+	std::string tmpV;
 	{
-		return ""; // 发现被删除了，返回“”
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		if (searchInMem(key, tmpV))
+		{
+			// 在内存中找到，直接返回；发现被删除了，返回“”
+			return tmpV == DELETEFLAG ? "" : tmpV;
+		}
 	}
+	std::shared_lock<std::shared_mutex> diskLock(diskMutex);
 	tmpV = searchInDisk(key);
 	return tmpV;
 }
@@ -120,12 +495,27 @@ bool KVStore::del(uint64_t key)
  */
 void KVStore::reset()
 {
-	memTable.clear();
+	std::unique_lock<std::mutex> gcLock = lockGC();
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	// 等待正在落盘的immTable完成
+	flushDone.wait(lock, [this]()
+				   { return immTables.empty(); });
+	// 等待正在进行的合并完成
+	std::lock_guard<std::mutex> compactLock(compactMutex);
+	std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+	memTable->clear();
+	if (wal)
+	{
+		wal->reset();
+	}
 	this->vlog->reset();
+	if (valueCache)
+	{
+		valueCache->clear();
+	}
 	ssList->clear();
 	level_file_num.clear();
 	maxTime = 1;
-	memSize = 0;
 	int Level;
 	std::string directPath;
 	for (Level = 0, directPath = generateLevelName(Level); utils::dirExists(directPath); directPath = generateLevelName(++Level))
@@ -139,6 +529,7 @@ void KVStore::reset()
 		}
 		utils::rmdir(directPath.c_str());
 	}
+	manifest->rewrite(std::vector<std::vector<TableMeta>>());
 }
 
 /**
@@ -168,171 +559,486 @@ void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, s
 
 }
 
+/* 扫描vLog中从begin开始、不超过end的一批entry，返回扫描结束的位置，之前的entry都可以回收
+ * 仍然有效的value直接追加到vLog末尾，并生成一个第0层的SSTable指向新的位置，不经过memTable
+ * 返回时新的value、SSTable和MANIFEST都已经刷盘，调用者可以立即回收旧的副本
+ * 有效性检查和新SSTable的写入都在diskMutex中完成，新SSTable的时间戳比之后落盘的memTable都小，不会覆盖用户的新写入 */
+uint64_t KVStore::relocate(uint64_t begin, uint64_t end)
+{
+	uint64_t readSize = std::min<uint64_t>(end - begin, GCBATCHSIZE);
+	std::vector<char> buffer(readSize);
+	{
+		std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+		this->vlog->read(begin, buffer.data(), readSize);
+		// 第一个entry比一批还大时，单独读入这个entry
+		uint32_t checkSum, vlen;
+		uint64_t key;
+		if (readSize >= MAXENTRYOFFSET)
+		{
+			size_t entrySize = vLogEntry::decodeHeader(buffer.data(), checkSum, key, vlen) + vlen + 1;
+			if (entrySize > readSize && entrySize <= end - begin)
+			{
+				readSize = entrySize;
+				buffer.resize(readSize);
+				this->vlog->read(begin, buffer.data(), readSize);
+			}
+		}
+	}
+	// 解析entry：Magic(1) CheckSum(2或4) Key(8) vlen(4) Value \0
+	std::vector<std::pair<uint64_t, vLogEntry>> entrys; // 每个entry的位置
+	uint64_t currentSize = 0;
+	const char *dataPtr = buffer.data();
+	while (currentSize < readSize && currentSize + vLogEntry::headerSize(dataPtr[0]) <= readSize)
+	{
+		uint64_t Key;
+		uint32_t checkSum, vlen;
+		size_t headerLen = vLogEntry::decodeHeader(dataPtr, checkSum, Key, vlen);
+		if (currentSize + headerLen + vlen + 1 > readSize)
+		{
+			break; // 不完整的entry留到下一批
+		}
+		// 压缩的value解压后再搬运，写入时按当前的设置重新压缩
+		std::string value;
+		if (vLog::decodeValue(dataPtr[0], dataPtr + headerLen, vlen, value))
+		{
+			entrys.emplace_back(begin + currentSize, vLogEntry(Key, value));
+		}
+		else
+		{
+			std::cerr << "Error: Failed to decompress vLog entry at " << begin + currentSize << std::endl;
+		}
+		dataPtr += headerLen + vlen + 1;
+		currentSize += headerLen + vlen + 1;
+	}
+
+	// 按key排序后一次性确定整批entry是否有效
+	std::sort(entrys.begin(), entrys.end(), [](const auto &a, const auto &b)
+			  { return a.second.Key < b.second.Key; });
+	std::vector<uint64_t> keys;
+	keys.reserve(entrys.size());
+	for (const auto &e : entrys)
+	{
+		keys.push_back(e.second.Key);
+	}
+	std::vector<SSList::Location> locations;
+	std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+	this->ssList->searchBatch(keys, locations);
+	std::vector<vLogEntry> live;
+	for (size_t i = 0; i < entrys.size(); i++)
+	{
+		// 只有SSTable中最新的版本仍然指向这里才需要搬运；直接存放在SSTable中的value的offset不是vLog中的位置
+		const SSList::Location &loc = locations[i];
+		if (loc.table && loc.offset == entrys[i].first && loc.vlen != 0 && !SSTable::isInline(loc.vlen))
+		{
+			live.push_back(std::move(entrys[i].second));
+		}
+	}
+	if (!live.empty())
+	{
+		std::vector<SSTable::KOVPari> kovPairs;
+		std::string inlineValues;
+		this->vlog->put(live, kovPairs, inlineThreshold, inlineValues);
+		// 旧的副本会被打洞或回收，新的副本和指向它的SSTable必须先落盘
+		this->vlog->sync();
+		saveLevel0(kovPairs, inlineValues);
+		scheduleCompaction();
+	}
+	return begin + currentSize;
+}
+
 /**
  * This reclaims space from vLog by moving valid value and discarding invalid value.
  * chunk_size is the size in byte you should AT LEAST recycle.
  */
 void KVStore::gc(uint64_t chunk_size)
 {
-	uint64_t currentSize = 0; // 记录已经搜索过的size
-	uint32_t head = this->vlog->getHead();
-	uint32_t tail = this->vlog->getTail();
-	std::fstream file(this->vlogFileName.c_str(), std::ios::binary | std::ios::in);
-	file.seekg(tail);
-	// 先把chunk_size字节数据缓存到内存中
-	std::vector<char> buffer(3*chunk_size);
-	file.read(buffer.data(), 3*chunk_size);
-	file.close();
-	// 当搜索过的区域小时就继续循环
-	const char *dataPtr = buffer.data();
-	while (currentSize < chunk_size)
-	{
-		uint8_t Magic;
-        uint16_t CheckSum;
-        uint64_t Key;
-        uint32_t vlen;
-        std::string Value;
-		std::memcpy(&Magic, dataPtr, 1);
-		dataPtr += 1;
-		std::memcpy(&CheckSum, dataPtr, 2);
-		dataPtr += 2;
-		std::memcpy(&Key, dataPtr, 8);
-		dataPtr += 8;
-		std::memcpy(&vlen, dataPtr, 4);
-		dataPtr += 4;
-		// 读取 value 到临时缓冲区
-		std::vector<char> temp(vlen);
-		std::memcpy(temp.data(), dataPtr, vlen);
-		dataPtr += (vlen + 1);
-
-		// 将临时缓冲区中的数据转换为 std::string
-		Value.assign(temp.data(), temp.size());
-		// 读取vLogEntry结束
-
-		uint64_t tmpOffset = UINT64_MAX;
-		uint32_t tmpVlen = UINT32_MAX;
-		if (this->ssList->search(Key,tmpOffset,tmpVlen))
-		{
-			if ((tmpOffset == tail + currentSize) && (tmpVlen != 0))
+	std::unique_lock<std::mutex> gcLock = lockGC();
+	uint64_t head, tail;
+	{
+		std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+		head = this->vlog->getHead();
+		tail = this->vlog->getTail();
+	}
+	// 只扫描head之前的数据，head之后是gc搬运的数据；已经回收的segment直接跳过
+	uint64_t pos = tail;
+	uint64_t scanned = 0;
+	while (scanned < chunk_size && pos < head)
+	{
+		uint64_t end;
+		{
+			std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+			pos = this->vlog->skipReclaimed(pos);
+			end = std::min(head, this->vlog->nextReclaimed(pos));
+		}
+		if (pos >= end)
+		{
+			break;
+		}
+		uint64_t next = relocate(pos, end);
+		if (next == pos)
+		{
+			break; // 剩下的是不完整的entry
+		}
+		scanned += next - pos;
+		pos = next;
+	}
+	std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+	pos = this->vlog->skipReclaimed(pos);
+	// 先在超级块中记录新的tail再打洞，崩溃时不会让tail指向空洞
+	this->vlog->setTail(pos);
+	if (pos > tail)
+	{
+		this->vlog->punchHole(tail, pos - tail);
+		if (valueCache)
+		{
+			valueCache->eraseRange(tail, pos);
+		}
+	}
+}
+
+/* 搬走segment中有效的value并回收整个segment，stop返回true时中途放弃
+ * 调用者需持有gcMutex */
+bool KVStore::drainSegment(const vLog::Segment &seg, const std::function<bool(uint64_t)> &stop)
+{
+	uint64_t pos = seg.begin;
+	while (pos < seg.end)
+	{
+		uint64_t next = relocate(pos, seg.end);
+		if (next == pos || stop(next - pos))
+		{
+			return false;
+		}
+		pos = next;
+	}
+	std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+	this->vlog->reclaimSegment(seg.begin);
+	if (valueCache)
+	{
+		valueCache->eraseRange(seg.begin, seg.end);
+	}
+	return true;
+}
+
+void KVStore::gcSegments(uint64_t chunk_size)
+{
+	std::unique_lock<std::mutex> gcLock = lockGC();
+	std::vector<vLog::Segment> victims;
+	{
+		std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+		victims = this->vlog->pickSegments(chunk_size);
+	}
+	for (const vLog::Segment &seg : victims)
+	{
+		drainSegment(seg, [](uint64_t)
+					 { return false; });
+	}
+}
+
+std::unique_lock<std::mutex> KVStore::lockGC()
+{
+	{
+		std::lock_guard<std::mutex> lock(gcStateMutex);
+		gcWaiters++;
+		gcCv.notify_all();
+	}
+	std::unique_lock<std::mutex> gcLock(gcMutex);
+	std::lock_guard<std::mutex> lock(gcStateMutex);
+	gcWaiters--;
+	return gcLock;
+}
+
+/* 后台gc：失效数据的比例超过gcRatio时，每次回收失效数据最多的一个segment
+ * 每扫描一批entry之后按gcRate限速，关闭时尽快退出
+ * 有前台调用者等待gcMutex时放弃这个segment并释放gcMutex，已经搬走的value不会再被搬运，之后重新选择segment */
+void KVStore::gcLoop()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(gcStateMutex);
+			gcCv.wait_for(lock, std::chrono::milliseconds(GCINTERVAL), [this]()
+						  { return stopGC; });
+			if (stopGC)
+			{
+				return;
+			}
+		}
+		std::lock_guard<std::mutex> gcLock(gcMutex);
+		std::vector<vLog::Segment> victims;
+		{
+			std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+			if (this->vlog->garbageRatio() < gcRatio)
 			{
-				if(memTable.get(Key) != "")
+				continue;
+			}
+			victims = this->vlog->pickSegments(1);
+		}
+		if (victims.empty())
+		{
+			continue;
+		}
+		drainSegment(victims.front(), [this](uint64_t bytes)
+					 {
+			// 按扫描的字节数限速，等待期间可以被关闭或者前台的gc打断
+			auto delay = std::chrono::microseconds(gcRate == 0 ? 0 : bytes * 1000000 / gcRate);
+			std::unique_lock<std::mutex> lock(gcStateMutex);
+			return gcCv.wait_for(lock, delay, [this]()
+								 { return stopGC || gcWaiters > 0; }); });
+	}
+}
+
+void KVStore::scheduleCompaction()
+{
+	std::lock_guard<std::mutex> lock(compactStateMutex);
+	compactPending = true;
+	compactCv.notify_one();
+}
+
+void KVStore::compactLoop()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(compactStateMutex);
+			compactCv.wait(lock, [this]()
+						   { return stopCompact || compactPending; });
+			if (stopCompact)
+			{
+				return;
+			}
+			compactPending = false;
+		}
+		// 一直合并到没有需要合并的层，每次选分数最高的一层
+		while (true)
+		{
+			std::lock_guard<std::mutex> compactLock(compactMutex);
+			{
+				std::lock_guard<std::mutex> lock(compactStateMutex);
+				if (stopCompact)
 				{
-					currentSize += (ENTRYOFFSET + vlen + 1);
-					continue;
+					return;
 				}
-				// 找到了而且确定是最新的有效数据
-				this->put(Key, Value);
 			}
-			// 否则不做处理
+			int level;
+			{
+				std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+				level = pickCompaction();
+			}
+			if (level < 0)
+			{
+				break;
+			}
+			compact(level);
+			compactDone.notify_all();
 		}
-		// 没找到（不应该），不做处理，读下一个就行
-		currentSize += (ENTRYOFFSET + vlen + 1);
 	}
-	// 扫描完毕
-	saveMem();
-	utils::de_alloc_file(this->vlogFileName, tail, currentSize);
-	this->vlog->updateTail();
 }
 
-void KVStore::compact(int level)
+void KVStore::waitForCompaction()
 {
-	buffer->clear();
-	std::string SSTablePath;
-	int order = 0;
-	// 第0层直接从第0个SSTable进行合并
-	if (level == 0)
 	{
-		order = 0;
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		waitForFlush(lock);
 	}
-	// 其他层跳出超出本层的那部分进行合并
-	else
+	std::lock_guard<std::mutex> compactLock(compactMutex);
+	while (true)
 	{
-		order = 1 << (level + 1);
+		int level;
+		{
+			std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+			level = pickCompaction();
+		}
+		if (level < 0)
+		{
+			return;
+		}
+		compact(level);
+		compactDone.notify_all();
 	}
-	int old_file_num = level_file_num[level];
-	//删除本层多余的sst文件，并且放到合并buffer里面去
-	for (int i = order; i < old_file_num; i++)
+}
+
+int KVStore::pickCompaction() const
+{
+	// 第l层最多容纳2^(l+1)个SSTable，按文件数量和总大小中超出得更多的一项打分，超过1需要合并
+	int best = -1;
+	double bestScore = 1;
+	for (size_t level = 0; level < level_file_num.size(); level++)
 	{
-		SSTable *s = ssList->tables[level][order];
-		SSTablePath = SSTableName(level, s->minK(), s->maxK(), s->getTime());
-		std::fstream *input = new std::fstream(SSTablePath.c_str(), std::ios::binary | std::ios::in);
-		buffer->read(input);
-		delete input;
-		utils::rmfile(SSTablePath.c_str());
-		ssList->deleteTable(level, i);
-		level_file_num[level]--;
+		double limit = 1 << (level + 1);
+		double score = std::max(level_file_num[level] / limit, ssList->levelBytes(level) / (limit * MAXMEMSIZE));
+		if (score > bestScore)
+		{
+			best = level;
+			bestScore = score;
+		}
 	}
+	return best;
+}
 
+void KVStore::compact(int level)
+{
+	buffer->clear();
 	int nextL = level + 1;
-	std::vector<int> tableNums; // 有相同键值的SSTable的编号
-	if (level_file_num.size() == nextL)
+	bool nextEmpty;
+	/* 选取本层需要合并的SSTable
+	 * 合并期间其他线程只会在第0层添加SSTable，不会删除，所以选出的SSTable一直有效 */
+	std::vector<SSTable *> inputs;
 	{
-		//下一层为空的合并
-		buffer->compact(true);
-		createDirByLevel(nextL);
+		std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+		std::vector<SSTable *> &tables = ssList->tables[level];
+		// 第0层全部合并，其他层合并超出本层容量的部分，至少一个
+		size_t order = level == 0 ? 0 : std::min<size_t>(1 << (level + 1), tables.size() - 1);
+		inputs.assign(tables.begin() + order, tables.end());
+		nextEmpty = level_file_num.size() == (size_t)nextL;
+		if (nextEmpty)
+		{
+			createDirByLevel(nextL);
+		}
 	}
-	else
+
+	// 读取和写入文件时不持有diskMutex，读者仍然使用合并前的SSTable
+	VersionEdit edit;
+	std::vector<std::string> obsolete;
+	for (SSTable *t : inputs)
 	{
-		//下一层不为空
-		old_file_num = level_file_num[nextL];
-		int min = buffer->minKey();
-		int max = buffer->maxKey();
-		tableNums = ssList->Intersection(nextL, min, max);
-		size_t tableNumsSize = tableNums.size();
-		for (size_t i = 0; i < tableNumsSize; i++)
+		buffer->read(t);
+		edit.removeTable(level, t->getFileName().substr(t->getFileName().rfind('/') + 1));
+		obsolete.push_back(t->getFileName());
+	}
+	std::vector<SSTable *> nextInputs;
+	if (!nextEmpty)
+	{
+		{
+			std::shared_lock<std::shared_mutex> diskLock(diskMutex);
+			nextInputs = ssList->overlapping(nextL, buffer->minKey(), buffer->maxKey());
+		}
+		for (SSTable *t : nextInputs)
 		{
-			SSTablePath = SSTableName(nextL, ssList->MINSET[i], ssList->MAXSET[i], ssList->TIMESTAMPSET[i]);
-			std::fstream *input = new std::fstream(SSTablePath.c_str(), std::ios::binary | std::ios::in);
-			buffer->read(input);
-			input->close();
-			delete input;
-			utils::rmfile(SSTablePath.c_str());
-			level_file_num[nextL]--;
+			buffer->read(t);
+			edit.removeTable(nextL, t->getFileName().substr(t->getFileName().rfind('/') + 1));
+			obsolete.push_back(t->getFileName());
 		}
-		buffer->compact(false);
 	}
+	std::vector<SSTable *> outputs;
+	// 边归并边输出，每凑满一个SSTable就写入文件，下一层为空时可以丢弃删除标记
+	FilterPolicy policy = filterPolicyFor(nextL);
+	std::string data;
+	auto emit = [&](const std::vector<SSTable::KOVPari> &kovPairs, const std::string &values)
+	{
+		std::string SSTablePath = SSTableName(nextL, kovPairs.front().key, kovPairs.back().key, buffer->timeStamp);
+		// 输出可能与某个输入同名，而输入在替换之前还在被读者使用，需要换一个文件名
+		for (int n = 1; access(SSTablePath.c_str(), F_OK) == 0; n++)
+		{
+			SSTablePath = SSTableName(nextL, kovPairs.front().key, kovPairs.back().key, buffer->timeStamp);
+			SSTablePath.insert(SSTablePath.size() - 4, "-" + std::to_string(n));
+		}
+		VersionEdit pending;
+		pending.pendingTable(nextL, SSTablePath.substr(SSTablePath.rfind('/') + 1));
+		manifest->prepare(pending);
+		data.clear();
+		SSTable::encodeTable(data, buffer->timeStamp, kovPairs, values, policy);
+		std::fstream output(SSTablePath.c_str(), std::ios::out | std::ios::binary);
+		output.write(data.data(), data.size());
+		output.close();
+		Manifest::syncFile(SSTablePath);
+		std::fstream input(SSTablePath.c_str(), std::ios::in | std::ios::binary);
+		SSTable *t = ssList->loadSSTable(nextL, 0, &input, SSTablePath);
+		edit.addTable(tableMeta(nextL, SSTablePath, t, data.size()));
+		outputs.push_back(t);
+	};
+	buffer->compact(nextEmpty, policy, emit);
+	// 输出落盘之后再提交edit，崩溃时要么看到合并前的文件，要么看到合并后的文件
+	manifest->apply(edit);
 
-	// 若非空，就继续写文件
-	while (!buffer->isEmpty())
+	// 一次性替换SSTable，读者看到的要么全部是合并前的SSTable，要么全部是合并后的
+	{
+		std::unique_lock<std::shared_mutex> diskLock(diskMutex);
+		ssList->removeTables(level, inputs);
+		level_file_num[level] -= inputs.size();
+		ssList->removeTables(nextL, nextInputs);
+		level_file_num[nextL] -= nextInputs.size();
+		for (SSTable *t : outputs)
+		{
+			t->changeId(level_file_num[nextL]);
+			ssList->addToList(nextL, level_file_num[nextL], t, false);
+			level_file_num[nextL]++;
+		}
+		ssList->rebuildFences(nextL);
+		// 被丢弃的旧版本在vLog中的数据已经失效
+		for (const SSTable::KOVPari &p : buffer->getDiscarded())
+		{
+			if (p.vlen != 0 && !SSTable::isInline(p.vlen))
+			{
+				vlog->markDead(p.offset, p.vlen);
+			}
+		}
+	}
+	// 读者在diskMutex的保护下使用SSTable，替换之后旧的SSTable不会再被访问
+	for (SSTable *t : inputs)
 	{
-		SSTablePath = SSTableName(nextL, buffer->getData_Tmp().front().key, buffer->getData_Tmp().back().key, buffer->timeStamp);
-		level_file_num[nextL]++;
-		std::fstream *output = new std::fstream(SSTablePath.c_str(), std::ios::out | std::ios::binary);
-		buffer->write(output);
-		output->close();
-		delete output;
-		std::fstream *input = new std::fstream(SSTablePath.c_str(), std::ios::in | std::ios::binary);
-		ssList->readSSTable(nextL, level_file_num[nextL] - 1, input);
-		input->close();
-		delete input;
+		delete t;
 	}
-	// 如果该层数量还是太多继续递归
-	if (level_file_num[nextL] > (1 << (1 + nextL)))
+	for (SSTable *t : nextInputs)
 	{
-		compact(nextL);
+		delete t;
+	}
+	for (const std::string &path : obsolete)
+	{
+		utils::rmfile(path.c_str());
 	}
 }
 
+FilterPolicy KVStore::filterPolicyFor(int level) const
+{
+	FilterPolicy policy = filterPolicy;
+	if (!levelFilterTypes.empty())
+	{
+		policy.type = levelFilterTypes[std::min<size_t>(level, levelFilterTypes.size() - 1)];
+	}
+	return policy;
+}
+
 std::string KVStore::searchInDisk(uint64_t key)
 {
 	// 先在缓存中查询
 	std::string res;
 	uint64_t offset = 0;
 	uint32_t vlen = 0;
-	SSTable *tmp = ssList->search(key, offset, vlen);
+	SSTable *tmp = ssList->search(key, offset, vlen, res);
 	if (!tmp || vlen == 0)
 	{
 		return "";
 	}
+	if (SSTable::isInline(vlen))
+	{
+		return res;
+	}
+	if (valueCache && offset >= this->vlog->getTail() && valueCache->lookup(offset, res))
+	{
+		return res; // 命中value缓存
+	}
 	// 不为空，去vLog读出相应字符串
 	if (!this->vlog->get(res, offset, vlen))
 	{
 		// 拿取错误
 		return "";
 	}
+	if (valueCache)
+	{
+		valueCache->insert(offset, res);
+	}
 	return res;
 }
 
+ValueCache::Stats KVStore::cacheStats()
+{
+	if (!valueCache)
+	{
+		return ValueCache::Stats{0, 0, 0};
+	}
+	return valueCache->getStats();
+}
+
 std::string KVStore::createDirByLevel(int le)
 {
 	std::string pathName = generateLevelName(le);
@@ -340,6 +1046,8 @@ std::string KVStore::createDirByLevel(int le)
 	{
 		utils::mkdir(pathName.c_str());
 		level_file_num.push_back(0);
+		// ssList的层数和level_file_num保持一致，合并没有输出时新的层也是空的
+		ssList->addLevels(level_file_num.size());
 	}
 	return pathName;
 }
@@ -356,59 +1064,47 @@ std::string KVStore::SSTableName(int idx, uint64_t min, uint64_t max, uint64_t t
 	return pathName;
 }
 
-void KVStore::saveMem()
+void KVStore::saveMem(MemTable &mem)
 {
-	// 首先将memTable的KV写入vLog，然后返回需要写入sstable的KOVPairs
-	uint64_t size = memTable.size();
-	if(size == 0)
+	// 首先将mem的KV写入vLog，然后返回需要写入sstable的KOVPairs
+	if (mem.size() == 0)
 		return;
 	std::vector<SSTable::KOVPari> kovPairs;
-	this->vlog->put(this->memTable, kovPairs);
-	const uint64_t min = memTable.minKey();
-	const uint64_t max = memTable.maxKey();
+	std::string inlineValues;
+	this->vlog->put(mem, kovPairs, inlineThreshold, inlineValues);
+	// 落盘之后对应的WAL会被删除，SSTable引用的vLog数据必须先刷盘
+	this->vlog->sync();
+	saveLevel0(kovPairs, inlineValues);
+}
+
+void KVStore::saveLevel0(const std::vector<SSTable::KOVPari> &kovPairs, const std::string &inlineValues)
+{
+	const uint64_t min = kovPairs.front().key;
+	const uint64_t max = kovPairs.back().key;
 	std::string Level_0 = createDirByLevel(0);
-	// 这里返回的kovPairs里面可能含有vlen = 0的，表示这key是被删除的
+	// 这里的kovPairs里面可能含有vlen = 0的，表示这key是被删除的
 	std::string ssTableName = SSTableName(0, min, max, maxTime);
 
 	level_file_num[0] += 1;
+	VersionEdit pending;
+	pending.pendingTable(0, ssTableName.substr(ssTableName.rfind('/') + 1));
+	manifest->prepare(pending);
 	std::fstream output(ssTableName.c_str(), std::ios::binary | std::ios::out);
-	// 时间戳
-	output.write((char *)&maxTime, sizeof(maxTime));
+	std::string buffer;
+	buffer.reserve(sizeof(SSTable::Header) + kovPairs.size() * KOVSIZE + inlineValues.size());
+	SSTable::encodeTable(buffer, maxTime, kovPairs, inlineValues, filterPolicyFor(0));
 	maxTime++;
-	// 键值对数量
-	output.write((char *)&size, sizeof(size));
-	// 最小键
-	output.write((char *)&min, sizeof(min));
-	// 最大键
-	output.write((char *)&max, sizeof(max));
-	// 写入bf
-	std::vector<bool> bf;
-	memTable.getBF(bf);
-	size_t bfSize = bf.size();
-	std::vector<char> bfBuffer((bfSize + 7) / 8); // Buffer to hold BF data
-	for (size_t i = 0; i < bfSize; ++i)
-	{
-		if (bf[i])
-		{
-			bfBuffer[i / 8] |= (1 << (7 - (i % 8))); // Set corresponding bit in buffer
-		}
-	}
-	output.write(bfBuffer.data(), bfBuffer.size());
-	std::vector<char> buffer;
-	buffer.reserve(kovPairs.size() * KOVSIZE);
-	for (SSTable::KOVPari kovP : kovPairs)
-	{
-		buffer.insert(buffer.end(), reinterpret_cast<char *>(&kovP.key), reinterpret_cast<char *>(&kovP.key) + sizeof(kovP.key));
-		buffer.insert(buffer.end(), reinterpret_cast<char *>(&kovP.offset), reinterpret_cast<char *>(&kovP.offset) + sizeof(kovP.offset));
-		buffer.insert(buffer.end(), reinterpret_cast<char *>(&kovP.vlen), reinterpret_cast<char *>(&kovP.vlen) + sizeof(kovP.vlen));
-	}
 	output.write(buffer.data(), buffer.size());
 	output.close();
 
 	// 将新的SSTable加入SSList监管
 	std::fstream input(ssTableName.c_str(), std::ios::binary | std::ios::in);
-	ssList->readSSTable(0, level_file_num[0] - 1, &input);
+	SSTable *t = ssList->readSSTable(0, level_file_num[0] - 1, &input, ssTableName);
 	input.close();
-	memTable.clear();
-	memSize = 0;
+
+	// 记录到MANIFEST之后这个SSTable才算存在
+	Manifest::syncFile(ssTableName);
+	VersionEdit edit;
+	edit.addTable(tableMeta(0, ssTableName, t, buffer.size()));
+	manifest->apply(edit);
 }
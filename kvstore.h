@@ -5,15 +5,49 @@
 #include "SSList.h"
 #include "vLog.h"
 #include "CompactBuffer.h"
+#include "WAL.h"
+#include "Manifest.h"
+#include "WriteBatch.h"
+#include "ValueCache.h"
 #include <string>
 #include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 
+struct KVStoreOptions
+{
+	bool useWAL = true;                                // 是否启用WAL
+	WALSyncMode walSyncMode = WALSyncMode::INTERVAL;   // WAL刷盘策略
+	uint32_t walSyncInterval = 10;                     // INTERVAL策略下的刷盘间隔(ms)
+	bool vlogMmap = false;                             // vLog通过mmap读取
+	ChecksumType vlogChecksum = ChecksumType::CRC32C;  // 新写入vLog的entry使用的校验和
+	CompressionType vlogCompression = CompressionType::NONE; // 新写入vLog的value是否使用LZ压缩
+	size_t valueCacheSize = 8 * 1024 * 1024;           // value缓存的大小(字节)，0表示不使用
+	size_t blockCacheSize = 8 * 1024 * 1024;           // SSTable数据block缓存的大小(字节)，0表示每次从文件读取
+	size_t maxOpenFiles = 500;                         // 同时保持打开的SSTable文件数量上限，0表示每次读取临时打开
+	uint32_t openThreads = 4;                          // 启动时并行读取SSTable的线程数
+	bool lazyIndex = false;                            // 启动时只读取SSTable的header和过滤器，index在第一次查找时读取
+	size_t indexCacheSize = 4 * 1024 * 1024;           // lazyIndex时缓存的index大小(字节)，0表示每次从文件读取
+	uint32_t bloomBitsPerKey = 10;                     // 新SSTable的Bloom Filter中每个key占用的bit数
+	std::vector<FilterType> levelFilterTypes;          // 第i层新SSTable使用的过滤器，更深的层沿用最后一项，为空时都使用BLOCKED_BLOOM
+	uint32_t valueSeparationThreshold = 64;            // 小于该长度的value直接存放在SSTable中，0表示全部写入vLog
+	double gcGarbageRatio = 0.5;                       // vLog中失效数据超过该比例时后台gc开始回收，0表示不启用后台gc
+	uint64_t gcRateLimit = 64 * 1024 * 1024;           // 后台gc每秒最多扫描的字节数，0表示不限速
+};
 
 class KVStore : public KVStoreAPI
 {
 private:
-	//内存
-	MemTable memTable;
+	//内存，写满后转为只读的immTable，由后台线程写入磁盘
+	std::shared_ptr<MemTable> memTable;
+	//等待落盘的只读MemTable，越靠前越旧
+	std::deque<std::shared_ptr<MemTable>> immTables;
 	//根目录
 	std::string sstDir;
 
@@ -24,31 +58,123 @@ private:
 	std::vector<int> level_file_num;
 	//管辖所有SSTable
 	SSList *ssList;
+	//SSTable集合的版本日志
+	Manifest *manifest;
+	//启动时读取SSTable的线程数
+	uint32_t openThreads;
 	//vLog文件
 	vLog *vlog;
 	//用于合并的缓冲区
 	CompactBuffer *buffer;
+	//vLog的value缓存，未启用时为nullptr
+	ValueCache *valueCache;
+	//小于该长度的value不写入vLog
+	uint32_t inlineThreshold;
+	//生成SSTable时使用的过滤器
+	FilterPolicy filterPolicy;
+	std::vector<FilterType> levelFilterTypes;
 	
 	uint64_t maxTime; //记录最大的时间戳
 
-	size_t memSize;
+	/* mutex保护memTable和immTables，put持有共享锁并发插入，切换memTable需要独占锁
+	 * diskMutex保护SSList、vLog和level_file_num，落盘、合并时独占 */
+	std::shared_mutex mutex;
+	std::shared_mutex diskMutex;
+
+	//后台落盘线程
+	std::thread flushThread;
+	std::condition_variable_any flushCv;   // 有新的immTable需要落盘
+	std::condition_variable_any flushDone; // 有immTable完成了落盘
+	bool stopFlush;
+
+	/* 后台gc线程，gcMutex保证同一时间只有一个gc在搬运数据
+	 * gcWaiters是等待gcMutex的前台调用者数量，由gcStateMutex保护，大于0时后台gc放弃当前的segment */
+	std::thread gcThread;
+	std::mutex gcMutex;
+	std::mutex gcStateMutex;
+	std::condition_variable gcCv;
+	bool stopGC;
+	int gcWaiters;
+	double gcRatio;
+	uint64_t gcRate;
+
+	/* 后台合并线程，compactMutex保证同一时间只有一个合并，合并时只在选取输入和替换SSTable时持有diskMutex
+	 * compactPending表示SSTable集合有变化，需要重新检查是否要合并 */
+	std::thread compactThread;
+	std::mutex compactMutex;
+	std::mutex compactStateMutex;
+	std::condition_variable compactCv;
+	std::condition_variable_any compactDone; // 完成了一次合并，与diskMutex一起使用
+	bool compactPending;
+	bool stopCompact;
+
+	//WAL，未启用时为nullptr
+	WAL *wal;
+	//等待写入WAL的put，队首的线程负责把队列中的写入合并成一条record
+	struct Writer
+	{
+		const WriteBatch *batch;
+		bool done;
+		bool ok; // 队首线程提交的结果
+		std::condition_variable cv;
+		Writer(const WriteBatch *b) : batch(b), done(false), ok(false) {}
+	};
+	std::mutex writeMutex;
+	std::deque<Writer *> writers;
 
+	//获取mutex的共享锁，并保证memTable还有空间
+	std::shared_lock<std::shared_mutex> lockForWrite();
+	//把batch写入memTable，调用者需持有mutex
+	void applyBatch(const WriteBatch &batch);
+	//启动时从MANIFEST得到每层的SSTable并读入ssList
+	void loadTables();
+	static TableMeta tableMeta(int level, const std::string &path, const SSTable *t, uint64_t fileSize);
+	//启动时回放WAL
+	void recoverWAL(const KVStoreOptions &options);
+
+	//memTable写满时转为immTable，force为true时只要非空就转换；immTable过多时等待
+	void makeRoomForWrite(std::unique_lock<std::shared_mutex> &lock, bool force);
+	//把memTable转为immTable，并等待所有immTable落盘
+	void waitForFlush(std::unique_lock<std::shared_mutex> &lock);
+	void flushLoop();
+	//在memTable和immTables中从新到旧查找，调用者需持有mutex
+	bool searchInMem(uint64_t key, std::string &value);
+	//gc时搬运vLog中从begin开始的一批有效value，返回扫描结束的位置
+	uint64_t relocate(uint64_t begin, uint64_t end);
+	//搬走segment中有效的value并回收，stop(本批扫描的字节数)返回true时放弃
+	bool drainSegment(const vLog::Segment &seg, const std::function<bool(uint64_t)> &stop);
+	void gcLoop();
+	//前台的gc、gcSegments和reset通过它获取gcMutex，正在限速等待的后台gc会让出
+	std::unique_lock<std::mutex> lockGC();
 	//存储到磁盘
-	void saveMem();
-	//合并函数
+	void saveMem(MemTable &mem);
+	//把排好序的kovPairs写成第0层的SSTable，调用者需持有diskMutex
+	void saveLevel0(const std::vector<SSTable::KOVPari> &kovPairs, const std::string &inlineValues);
+	//通知后台线程检查是否需要合并
+	void scheduleCompaction();
+	void compactLoop();
+	//分数最高且需要合并的层，没有返回-1，调用者需持有diskMutex
+	int pickCompaction() const;
+	//把level层的一部分SSTable合并到下一层，调用者需持有compactMutex
 	void compact(int level);
 
 	std::string searchInDisk(uint64_t key);
 	std::string createDirByLevel(int level);
 	std::string generateLevelName(int level);
 	std::string SSTableName(int idx, uint64_t min, uint64_t max, uint64_t time);
+	//第level层的新SSTable使用的过滤器
+	FilterPolicy filterPolicyFor(int level) const;
 public:
-	KVStore(const std::string &dir, const std::string &vlog);
+	KVStore(const std::string &dir, const std::string &vlog, const KVStoreOptions &options = KVStoreOptions());
 
 	~KVStore();
 
 	void put(uint64_t key, const std::string &s) override;
 
+	/* 原子地写入一组put/del，batch中的操作总是进入同一个MemTable
+	 * 启用WAL时整个batch作为一条record写入，写入WAL失败时batch不生效，返回false */
+	bool write(const WriteBatch &batch);
+
 	std::string get(uint64_t key) override;
 
 	bool del(uint64_t key) override;
@@ -60,4 +186,15 @@ public:
 
 	void gc(uint64_t chunk_size) override;
 
+	/* 优先回收失效数据最多的vLog segment，至少回收chunk_size字节(如果有足够的候选)
+	 * gc只能从tail开始按顺序回收，这里可以回收tail之后任意位置的segment */
+	void gcSegments(uint64_t chunk_size);
+
+	/* 把memTable落盘，并完成所有需要的合并，返回时没有需要合并的层
+	 * 后台合并正在进行时等待它结束，剩下的合并在调用者的线程中完成 */
+	void waitForCompaction();
+
+	//value缓存的命中统计
+	ValueCache::Stats cacheStats();
+
 };
@@ -1,12 +1,17 @@
 #pragma once
 #include <cstdint>
-#include <stack>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <thread>
 #include <string>
+#include <cstring>
 #include <ctime>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
 #include <map>
+#include "Arena.h"
 #include "vLogEntry.h"
 #include "ssTable.h"
 #include "MurmurHash3.h"
@@ -14,315 +19,318 @@
 class MemTable
 {
 private:
+    static const int MAXHEIGHT = 16;
+
+    /* 每个key只有一个节点，节点、变长的next数组以及value都在arena中一次分配
+     * 覆盖写时在arena中重新分配value，旧的value随arena一起回收
+     * 插入通过CAS链接各层指针，支持多个写线程并发插入，读操作不加锁
+     */
     struct Node
     {
         uint64_t key;
-        std::string val;
-        Node *right, *down;
-        Node(uint64_t _key, std::string &_val) : right(nullptr), down(nullptr), key(_key), val(_val) {}
-        Node() : right(nullptr), down(nullptr), key(0), val("") {}
-        Node(Node *r, Node *d, uint64_t _key, std::string _val) : right(r), down(d), key(_key), val(_val) {}
-    };
+        std::atomic<const char *> val; // 前4字节为vlen，之后是value
+        uint32_t height;
+        std::atomic<Node *> next[1]; // 实际长度为height
 
-    Node *head;
-    void clear(Node *n)
-    {
-        while (n)
+        std::string value() const
         {
-            Node *next = n->down;
-            while (n)
-            {
-                Node *tmp = n->right;
-                delete n;
-                n = tmp;
-            }
-            n = next;
+            const char *v = val.load(std::memory_order_acquire);
+            uint32_t vlen;
+            std::memcpy(&vlen, v, sizeof(vlen));
+            return std::string(v + sizeof(vlen), vlen);
         }
-    }
 
-public:
-    MemTable()
+        Node *getNext(int level) const
+        {
+            return next[level].load(std::memory_order_acquire);
+        }
+    };
+
+    Arena arena;
+    Node *head;
+    std::atomic<int> maxHeight; // 当前跳表的最大高度
+    std::atomic<size_t> count;  // 节点数量
+    // 小于该长度的value落盘时直接存放在SSTable中，inlineBytes记录这部分value的总长度
+    uint32_t inlineThreshold;
+    std::atomic<size_t> inlineBytes;
+
+    size_t inlinePart(size_t vlen) const
     {
-        head = new Node();
+        return vlen < inlineThreshold ? vlen : 0;
     }
-    ~MemTable()
+
+    // 把vlen和value写入mem
+    static void encodeValue(char *mem, const std::string &val)
     {
-        clear(head);
+        uint32_t vlen = val.size();
+        std::memcpy(mem, &vlen, sizeof(vlen));
+        std::memcpy(mem + sizeof(vlen), val.data(), vlen);
     }
 
-    void clear()
+    Node *newNode(uint64_t key, const std::string &val, int height)
     {
-        clear(head);
-        head = new Node();
+        size_t size = sizeof(Node) + sizeof(std::atomic<Node *>) * (height - 1);
+        char *mem = arena.allocate(size + sizeof(uint32_t) + val.size());
+        Node *n = new (mem) Node;
+        n->key = key;
+        n->height = height;
+        encodeValue(mem + size, val);
+        n->val.store(mem + size, std::memory_order_relaxed);
+        for (int i = 0; i < height; i++)
+            new (&n->next[i]) std::atomic<Node *>(nullptr);
+        return n;
     }
 
-    bool empty()
+    // 覆盖已有节点的value
+    void overwrite(Node *n, const std::string &val)
     {
-        Node *tmp = head;
-        while (tmp->down)
-        {
-            tmp = tmp->down; // go down
-        }
-        return !tmp->right;
+        char *mem = arena.allocate(sizeof(uint32_t) + val.size());
+        encodeValue(mem, val);
+        const char *old = n->val.exchange(mem, std::memory_order_acq_rel);
+        uint32_t oldLen;
+        std::memcpy(&oldLen, old, sizeof(oldLen));
+        inlineBytes.fetch_add(inlinePart(val.size()), std::memory_order_relaxed);
+        inlineBytes.fetch_sub(inlinePart(oldLen), std::memory_order_relaxed);
     }
 
-    size_t size()
+    static int randomHeight()
     {
-        size_t n = 0;
-        Node *tmp = head;
-        while (tmp->down)
-        {
-            tmp = tmp->down; // go down
-        }
-
-        while (tmp->right)
+        // 每个线程独立的xorshift，避免rand()的全局锁
+        static thread_local uint32_t seed =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        int height = 1;
+        // 50%的概率向上一层
+        while (height < MAXHEIGHT)
         {
-            tmp = tmp->right;
-            ++n;
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            if (!(seed & 1))
+                break;
+            height++;
         }
-        return n;
+        return height;
     }
 
-    std::string get(uint64_t &_key) const
+    // 返回第一个key >= _key的节点，prev非空时记录每一层的前驱
+    Node *findGreaterOrEqual(uint64_t _key, Node **prev) const
     {
         Node *p = head;
+        int level = maxHeight.load(std::memory_order_relaxed) - 1;
         while (true)
         {
-            while (p->right && p->right->key < _key)
+            Node *next = p->getNext(level);
+            if (next && next->key < _key)
             {
-                p = p->right;
+                p = next; // 向右
+            }
+            else
+            {
+                if (prev)
+                    prev[level] = p;
+                if (level == 0)
+                    return next;
+                level--; // 向下
             }
-            if (p->right && p->right->key == _key)
-                return p->right->val;
-            if (!p->down)
-                return "";
-            p = p->down;
         }
     }
 
-    bool put(uint64_t &key, const std::string &val)
+    // 从before开始，在level层找到满足 prev->key < key <= next->key 的位置
+    static void findSpliceForLevel(uint64_t key, Node *before, int level, Node **prev, Node **next)
     {
-        Node *p = head;
-        std::vector<Node *> pathList; // 只记录从上到下的搜索路径
-        bool exist = false;
-        while (p)
+        while (true)
         {
-            // 如果右边的节点存在并且该节点的键值小于要插入的键值，向右移动
-            while (p->right && p->right->key < key)
-                p = p->right;
-            if (p->right && p->right->key == key)
+            Node *after = before->getNext(level);
+            if (!after || after->key >= key)
             {
-                p->right->val = val; // 覆盖val
-                exist = true;
+                *prev = before;
+                *next = after;
+                return;
             }
-            // 找到对应的从上到下的路径
-            pathList.push_back(p);
-            // 该节点的键值小于key，但右节点的键的值大于key
-            p = p->down;
-        }
-        if (exist)
-            return false; // 已经覆盖完毕，return
-        // 不存在这样的一个键值
-        Node *downNode = nullptr;
-        bool Up = true; // 代表是否需要往上插入
-        // 从下至上搜索路径回溯，50%概率
-        while (Up && pathList.size() > 0)
-        {
-            // 取出末尾的节点，当前节点的键值小于key，但是该节点右节点的键值又大于key
-            Node *newNode = pathList.back();
-            pathList.pop_back();
-            newNode->right = new Node(newNode->right, downNode, key, val);
-            downNode = newNode->right;
-            Up = (rand() & 1);
+            before = after;
         }
-        // 可能会有超出原来跳表高度的情况，这个时候需要插入新的头结点
-        if (Up)
-        { // 插入新的头结点，加层
-            Node *oldHead = head;
-            head = new Node();
-            head->right = new Node(nullptr, downNode, key, val);
-            head->down = oldHead;
-        }
-        return true;
     }
 
-    bool search(Node *&list, Node *&p, const uint64_t &k)
+    Node *first() const
     {
+        return head->getNext(0);
+    }
 
+    Node *last() const
+    {
+        Node *p = head;
+        int level = maxHeight.load(std::memory_order_relaxed) - 1;
         while (true)
         {
-            while (p->right && p->right->key < k)
-            {
-                p = p->right;
-            }
-            if (p->right && p->right->key == k)
-            {
-                p = p->right;
-                return true;
-            }
-            list = list->down;
-            if (!list)
-                return false;
-            p = list;
+            Node *next = p->getNext(level);
+            if (next)
+                p = next;
+            else if (level == 0)
+                return p;
+            else
+                level--;
         }
     }
 
-    bool remove(const uint64_t &key)
+    void init()
     {
-        Node *p = head;
-        while (true)
+        head = newNode(0, "", MAXHEIGHT);
+        maxHeight.store(1, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        inlineBytes.store(0, std::memory_order_relaxed);
+    }
+
+public:
+    MemTable(uint32_t _inlineThreshold = 0) : inlineThreshold(_inlineThreshold)
+    {
+        init();
+    }
+    ~MemTable() {}
+
+    // 直接重置arena，不需要逐个释放节点；调用者需保证没有并发访问
+    void clear()
+    {
+        arena.reset();
+        init();
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t size() const
+    {
+        return count.load(std::memory_order_acquire);
+    }
+
+    // 落盘时直接存放在SSTable中的value的总长度
+    size_t inlineSize() const
+    {
+        return inlineBytes.load(std::memory_order_relaxed);
+    }
+
+    size_t memoryUsage() const
+    {
+        return arena.memoryUsage();
+    }
+
+    std::string get(uint64_t &_key) const
+    {
+        Node *n = findGreaterOrEqual(_key, nullptr);
+        if (n && n->key == _key)
+            return n->value();
+        return "";
+    }
+
+    /* 插入或覆盖，可以被多个线程并发调用
+     * 新插入key返回true，覆盖已有key返回false
+     */
+    bool put(uint64_t &key, const std::string &val)
+    {
+        Node *prev[MAXHEIGHT];
+        Node *next[MAXHEIGHT];
+        int height = maxHeight.load(std::memory_order_relaxed);
+        Node *before = head;
+        for (int i = height - 1; i >= 0; i--)
         {
-            while (p->right && p->right->key < key)
-                p = p->right;
-            if (p->right && p->right->key == key)
-                break;
-            if (!p->down)
-                return false;
-            p = p->down;
+            findSpliceForLevel(key, before, i, &prev[i], &next[i]);
+            before = prev[i];
         }
-
-        Node *tmp = p->right;
-        while (true)
+        if (next[0] && next[0]->key == key)
         {
-            p->right = tmp->right;
-            Node *next = tmp->down;
-            delete tmp;
+            overwrite(next[0], val);
+            return false;
+        }
 
-            if (!next)
+        int newHeight = randomHeight();
+        // CAS失败时会把cur改成当前的最大高度，height要保留下来，它以上的prev/next都还没有找过
+        int cur = height;
+        while (newHeight > cur)
+        {
+            if (maxHeight.compare_exchange_weak(cur, newHeight, std::memory_order_relaxed))
                 break;
-            p = p->down;
-            while (p->right != next)
-                p = p->right;
-            tmp = next;
         }
-
-        while (head->down && !head->right)
+        // 超出查找时跳表高度的部分，前驱先设为头结点，期间其他线程插入的节点在CAS失败时重新查找
+        for (int i = height; i < newHeight; i++)
         {
-            tmp = head;
-            head = tmp->down;
-            delete tmp;
+            prev[i] = head;
+            next[i] = nullptr;
         }
 
+        Node *n = newNode(key, val, newHeight);
+        for (int i = 0; i < newHeight; i++)
+        {
+            while (true)
+            {
+                n->next[i].store(next[i], std::memory_order_relaxed);
+                if (prev[i]->next[i].compare_exchange_strong(next[i], n, std::memory_order_release))
+                    break;
+                // CAS失败说明有其他线程在这里插入了节点，重新找位置
+                findSpliceForLevel(key, prev[i], i, &prev[i], &next[i]);
+                if (i == 0 && next[0] && next[0]->key == key)
+                {
+                    // 其他线程先插入了相同的key，n还没有被链接进任何一层，直接覆盖对方
+                    overwrite(next[0], val);
+                    return false;
+                }
+            }
+        }
+        inlineBytes.fetch_add(inlinePart(val.size()), std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_release);
         return true;
     }
+
     void show()
     {
-        Node *p = head;
-        while (p)
+        for (int level = maxHeight - 1; level >= 0; level--)
         {
-            Node *node = p->right;
             std::cout << "head";
-            while (node)
+            for (Node *node = head->getNext(level); node; node = node->getNext(level))
             {
-                std::cout << "-->" << node->val;
-                node = node->right;
+                std::cout << "-->" << node->value();
             }
             std::cout << "-->NULL" << std::endl;
-            p = p->down;
-            // std::cout << p->down->val;
         }
     };
 
-    void getAllNodes(std::vector<vLogEntry> &entrys) const
+    // 按key从小到大对每个节点调用visit(key, value, vlen)，value指向arena中的数据，不做拷贝
+    template <typename Visit>
+    void forEach(const Visit &visit) const
     {
-        entrys.clear();
-
-        size_t n = 0;
-        Node *tmp = head;
-        while (tmp->down)
+        for (Node *n = first(); n; n = n->getNext(0))
         {
-            tmp = tmp->down;
+            const char *v = n->val.load(std::memory_order_acquire);
+            uint32_t vlen;
+            std::memcpy(&vlen, v, sizeof(vlen));
+            visit(n->key, v + sizeof(vlen), vlen);
         }
-
-        Node *tmp2 = tmp;
-        while (tmp2->right)
-        {
-            tmp2 = tmp2->right;
-            ++n;
-        }
-        entrys.reserve(n);
-
-        while (tmp->right)
-        {
-            entrys.emplace_back(tmp->right->key, tmp->right->val);
-            tmp = tmp->right;
-        }
-        return;
     }
 
     uint64_t maxKey()
     {
-        Node *tmp = head;
-        while (tmp->down)
-        {
-            tmp = tmp->down;
-        }
-
-        while (tmp->right)
-            tmp = tmp->right;
-        uint64_t maxKey = tmp->key > 0 ? tmp->key : 0;
-        return maxKey;
+        return last()->key;
     }
 
     uint64_t minKey()
     {
-        Node *tmp = head;
-        while (tmp->down)
-        {
-            tmp = tmp->down;
-        }
-
-        if (tmp->right)
-            tmp = tmp->right;
-        uint64_t minKey = tmp->key > 0 ? tmp->key : 0;
-        return minKey;
-    }
-
-    void getBF(std::vector<bool> &bf)
-    {
-        bf.resize(BFSIZE, 0);
-        Node *tmp = head;
-        while (tmp->down)
-        {
-            tmp = tmp->down;
-        }
-        while (tmp->right)
-        {
-            uint32_t hash[4] = {0};
-            MurmurHash3_x64_128(&(tmp->right->key), sizeof(tmp->right->key), 1, hash);
-            bf[hash[0] % BFSIZE] = 1;
-            bf[hash[1] % BFSIZE] = 1;
-            bf[hash[2] % BFSIZE] = 1;
-            bf[hash[3] % BFSIZE] = 1;
-            tmp = tmp->right;
-        }
-        return;
+        Node *n = first();
+        return n ? n->key : 0;
     }
 
     void scan(uint64_t key1, uint64_t key2, std::map<uint64_t, std::string> &RMap)
     {
-        Node *tmp = head;
-        while (tmp->down)
+        //现在n到达了key >= key1的第一个位置 或到结束了
+        for (Node *n = findGreaterOrEqual(key1, nullptr); n; n = n->getNext(0))
         {
-            tmp = tmp->down; //到达最底层
-        }
-        while (tmp->right)
-        {
-            if(tmp->right->key < key1)
-                tmp = tmp->right;
-            else
-                break;
-        }
-        //现在tmp->right到达了key >= key1的第一个位置 或到结束了
-        while(tmp->right)
-        {
-            if(tmp->right->key > key2){
+            if (n->key > key2)
+            {
                 break;
             }
             //确认区间，而且要抛弃删除标记
-            if(tmp->right->key <= key2 && tmp->right->val != "~DELETED~")
-                RMap[tmp->right->key] =  tmp->right->val;
-            tmp = tmp->right;
+            std::string val = n->value();
+            if (val != "~DELETED~")
+                RMap[n->key] = val;
         }
         return;
     }
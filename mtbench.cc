@@ -0,0 +1,103 @@
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include "kvstore.h"
+
+/* 多线程PUT性能测试，线程数从1增加到硬件线程数
+ * 关闭WAL时各线程直接并发插入memTable；启用WAL时写入经过队列，由队首线程合并提交 */
+class MultiThreadTest
+{
+private:
+    const uint64_t TEST_MAX = 1024 * 48;
+    const size_t VALUE_SIZE = 64;
+
+    const std::string dir;
+    const std::string vlog;
+
+    void insert_test(KVStore &store, uint64_t max, unsigned threadNum)
+    {
+        std::vector<std::thread> threads;
+        auto t1 = std::chrono::system_clock::now();
+        for (unsigned t = 0; t < threadNum; t++)
+        {
+            // 每个线程交错地写入不相交的key
+            threads.emplace_back([this, &store, t, threadNum, max]()
+                                 {
+                for (uint64_t i = t; i < max; i += threadNum)
+                {
+                    store.put(i, std::string(VALUE_SIZE, 's'));
+                } });
+        }
+        for (std::thread &th : threads)
+        {
+            th.join();
+        }
+        auto t2 = std::chrono::system_clock::now();
+        auto duration_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+        std::cout << "threads: " << threadNum << "\tPUT: ";
+        report_throughput(duration_seconds, max / duration_seconds);
+    }
+
+    void report_throughput(double seconds, long ops_per_second)
+    {
+        std::cout << "time: " << seconds << "s\t"
+                                            "throughput: "
+                  << ops_per_second << " ops/s\n";
+    }
+
+public:
+    MultiThreadTest(const std::string &dir, const std::string &vlog) : dir(dir), vlog(vlog)
+    {
+    }
+
+    void run(bool useWAL)
+    {
+        KVStoreOptions options;
+        options.useWAL = useWAL;
+        KVStore store(dir, vlog, options);
+        std::cout << "WAL: " << (useWAL ? "on" : "off") << std::endl;
+        unsigned maxThreads = std::thread::hardware_concurrency();
+        if (maxThreads == 0)
+        {
+            maxThreads = 1;
+        }
+        for (unsigned n = 1;; n *= 2)
+        {
+            if (n > maxThreads)
+            {
+                n = maxThreads;
+            }
+            store.reset();
+            insert_test(store, TEST_MAX, n);
+            if (n == maxThreads)
+            {
+                break;
+            }
+        }
+        store.reset();
+    }
+
+    void start_test()
+    {
+        std::cout << "KVStore Multi-thread Insert Test" << std::endl;
+        run(false);
+        run(true);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    std::cout << "Usage: " << argv[0] << std::endl
+              << std::endl;
+    std::cout.flush();
+
+    MultiThreadTest test("./data", "./data/vlog");
+
+    test.start_test();
+
+    return 0;
+}
@@ -104,6 +104,8 @@ private:
         auto duration_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
         std::cout << "GET: ";
         report_throughput(duration_seconds, max / duration_seconds);
+        ValueCache::Stats stats = store.cacheStats();
+        std::cout << "value cache hits: " << stats.hits << "\tmisses: " << stats.misses << std::endl;
     }
 
     void compaction_test(uint64_t max)
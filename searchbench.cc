@@ -0,0 +1,106 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include "KeySearch.h"
+#include "ssTable.h"
+
+/* SSTable中key查找的微基准：在n个升序key中做随机查找，比较三种布局
+ * AoS：KOVPari数组上的std::lower_bound，即原来block中的查找方式
+ * SoA：单独的key数组上的branchlessLowerBound
+ * Eytzinger：BFS顺序的key数组，带预取
+ * 一半的查找key存在，一半不存在 */
+class SearchBench
+{
+private:
+    const size_t QUERY_NUM = 1000000;
+
+    std::mt19937_64 rng{20240601};
+    volatile uint64_t sink = 0; // 防止查找被优化掉
+
+    template <typename Search>
+    double measure(const std::vector<uint64_t> &queries, const Search &search)
+    {
+        uint64_t sum = 0;
+        auto t1 = std::chrono::steady_clock::now();
+        for (uint64_t q : queries)
+        {
+            sum += search(q);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        sink = sink + sum;
+        return std::chrono::duration<double, std::nano>(t2 - t1).count() / queries.size();
+    }
+
+    void run(size_t n)
+    {
+        // 间隔为2的key，奇数一定不存在
+        std::vector<uint64_t> keys(n);
+        std::vector<SSTable::KOVPari> pairs;
+        pairs.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            keys[i] = i * 2;
+            pairs.emplace_back(keys[i], i, 0);
+        }
+        EytzingerIndex eytzinger(keys.data(), n);
+
+        std::vector<uint64_t> queries(QUERY_NUM);
+        for (uint64_t &q : queries)
+        {
+            q = rng() % (2 * n);
+        }
+
+        // 三种查找的结果必须一致
+        for (size_t i = 0; i < 1000; i++)
+        {
+            uint64_t q = queries[i];
+            size_t a = std::lower_bound(pairs.begin(), pairs.end(), q, [](const SSTable::KOVPari &p, uint64_t k)
+                                        { return p.key < k; }) -
+                       pairs.begin();
+            if (a != branchlessLowerBound(keys.data(), n, q) || a != eytzinger.lowerBound(q))
+            {
+                std::cerr << "Error: mismatched result for key " << q << std::endl;
+                return;
+            }
+        }
+
+        double aos = measure(queries, [&pairs](uint64_t q)
+                             { return std::lower_bound(pairs.begin(), pairs.end(), q, [](const SSTable::KOVPari &p, uint64_t k)
+                                                       { return p.key < k; }) -
+                                      pairs.begin(); });
+        double soa = measure(queries, [&keys, n](uint64_t q)
+                             { return branchlessLowerBound(keys.data(), n, q); });
+        double eyt = measure(queries, [&eytzinger](uint64_t q)
+                             { return eytzinger.lowerBound(q); });
+        std::cout << "keys: " << n << "\tAoS lower_bound: " << aos << "ns\t"
+                  << "SoA branchless: " << soa << "ns\t"
+                  << "Eytzinger: " << eyt << "ns\n";
+    }
+
+public:
+    void start_test()
+    {
+        std::cout << "SSTable Key Search Test" << std::endl;
+        for (size_t n : {1000, 10000, 100000, 1000000})
+        {
+            run(n);
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    std::cout << "Usage: " << argv[0] << std::endl
+              << std::endl;
+    std::cout.flush();
+
+    SearchBench test;
+
+    test.start_test();
+
+    return 0;
+}
@@ -1,11 +1,35 @@
 #pragma once
-#include "MurmurHash3.h"
+#include "BlockCache.h"
+#include "FileCache.h"
+#include "Filter.h"
+#include "KeySearch.h"
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
 
-/* Bloom Filter 大小为8kB = 8*1024bytes 65536bits */
-#define BFSIZE 65536
+/* vlen的最高位为1表示value直接存放在SSTable中，此时offset是value在inlineValues中的位置 */
+#define INLINEFLAG 0x80000000u
+/* 文件末尾footer中的magic，SSTMAGIC是过滤器固定为8kB的格式，没有footer的是最早格式的文件 */
+#define SSTMAGIC 0x3176656c6b636f6cull
+#define SSTMAGIC2 0x3276656c6b636f6cull
+
+/* SSTable文件格式：
+ * Header(32) | 数据block... | 过滤器 | index | footer
+ * 每个block是连续的若干项：key(8) offset(8) vlen(4) [inline的value]
+ * index中每个block一项：第一个key(8) block的位置(8) block的长度(4) 项数(4)
+ * footer：过滤器的位置(8) 过滤器的长度(4) 过滤器类型(4) index的位置(8) block的数量(8) magic(8)
+ * 旧格式的文件在Header之后是固定8kB的Bloom Filter，footer只有 index的位置(8) block的数量(8) magic(8)
+ * 最早格式的文件在数据区之后没有index和footer，读取时按同样的规则在内存中切分block
+ */
 
 class SSTable
 {
@@ -27,6 +51,90 @@ public:
             : key(_key), offset(_offset), vlen(len) {}
     };
 
+    // index中的一项，记录一个block在文件中的位置
+    struct BlockHandle
+    {
+        uint64_t firstKey;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t count;
+    };
+
+    /* 解析后的block，inline的value的offset是在values中的位置
+     * 按列存放，查找时只扫描连续的keys数组，一个cache line可以容纳8个key */
+    struct Block
+    {
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> vlens;
+        std::string values;
+
+        size_t size() const
+        {
+            return keys.size();
+        }
+
+        // 第一个key >= key的项，没有则返回size()
+        size_t lowerBound(uint64_t key) const
+        {
+            return branchlessLowerBound(keys.data(), keys.size(), key);
+        }
+
+        // 在缓存中占用的字节数
+        size_t charge() const
+        {
+            return sizeof(Block) + keys.size() * (sizeof(uint64_t) * 2 + sizeof(uint32_t)) + values.size();
+        }
+    };
+
+    typedef BlockCache<Block> Cache;
+
+    // 稀疏索引，每个block一项；firstKeys是每个block的第一个key，单独存放以便查找
+    struct Index
+    {
+        std::vector<BlockHandle> blocks;
+        std::vector<uint64_t> firstKeys;
+
+        Index(std::vector<BlockHandle> &&_blocks) : blocks(std::move(_blocks))
+        {
+            firstKeys.reserve(blocks.size());
+            for (const BlockHandle &h : blocks)
+            {
+                firstKeys.push_back(h.firstKey);
+            }
+        }
+
+        // key可能所在的block，key小于第一个block的第一个key时返回0
+        size_t findBlock(uint64_t key) const
+        {
+            // 第一个firstKey > key的block的前一个
+            size_t i = key == UINT64_MAX ? firstKeys.size() : branchlessLowerBound(firstKeys.data(), firstKeys.size(), key + 1);
+            return i == 0 ? 0 : i - 1;
+        }
+
+        size_t charge() const
+        {
+            return sizeof(Index) + blocks.size() * (sizeof(BlockHandle) + sizeof(uint64_t));
+        }
+    };
+
+    // 延迟读取index时缓存index，以(SSTable的编号, 0)为键
+    typedef BlockCache<Index> IndexCache;
+
+    // 文件中各部分的位置，由readFooter得到
+    struct Footer
+    {
+        uint64_t dataOffset; // 数据区[dataOffset, dataEnd)
+        uint64_t dataEnd;
+        uint64_t filterOffset;
+        uint32_t filterSize;
+        FilterType filterType;
+        uint64_t indexOffset;
+        uint64_t blockNum;
+        bool hasIndex;
+        uint64_t fileSize;
+    };
+
 private:
     // 标记层号
     int level;
@@ -34,106 +142,451 @@ private:
     int id;
     Header header;
     uint64_t currentTime = 0;
+    // 常驻内存的index，延迟读取时为nullptr，通过indexCache按需读取
+    std::shared_ptr<const Index> index;
+    Footer footer;
+    std::string fileName;
+    std::unique_ptr<Filter> filter;
+    // 在block缓存和文件缓存中区分不同的SSTable，不会重复使用
+    uint64_t cacheId;
+    Cache *cache;
+    IndexCache *indexCache;
+    // block和index都通过pread读取，文件描述符由fileCache管理；为nullptr时每次读取临时打开
+    FileCache *fileCache;
 
-    /*返回key对应在SSTable里面的索引 没找到则返回 UINT64_MAX*/
-    uint64_t binarySearch(uint64_t key) const
+    static uint64_t nextCacheId()
     {
-        if (this->size() == 0)
+        static std::atomic<uint64_t> counter{0};
+        return counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 从文件的offset处读取len字节，打开或读取失败时抛出std::runtime_error
+    void readAt(char *buf, size_t len, uint64_t offset) const
+    {
+        std::shared_ptr<const FileHandle> file = fileCache ? fileCache->get(cacheId, fileName) : FileCache::openFile(fileName);
+        if (!file)
         {
-            return UINT64_MAX;
+            throw std::runtime_error("Failed to open " + fileName + ": " + std::strerror(errno));
         }
-
-        int low = 0, high = idx.size() - 1, mid = 0;
-        while (low <= high)
+        while (len > 0)
         {
-            mid = (low + high) / 2;
-            if (idx[mid].key == key)
+            ssize_t n = pread(file->fd, buf, len, offset);
+            if (n < 0 && errno == EINTR)
             {
-                return mid;
+                continue;
             }
-            else if (idx[mid].key > key)
+            if (n < 0)
             {
-                high = mid - 1;
+                throw std::runtime_error("Failed to read " + fileName + ": " + std::strerror(errno));
             }
-            else
+            if (n == 0)
             {
-                low = mid + 1;
+                throw std::runtime_error("Unexpected end of " + fileName);
             }
+            buf += n;
+            offset += n;
+            len -= n;
         }
-        return UINT64_MAX;
+    }
+
+    // 从文件中读取第i个block，数据损坏时抛出std::runtime_error
+    void loadBlock(const BlockHandle &h, size_t i, Block &block) const
+    {
+        std::vector<char> buf(h.size);
+        readAt(buf.data(), h.size, h.offset);
+        if (!decodeBlock(buf.data(), h.size, h.count, block))
+        {
+            throw std::runtime_error("Corrupted block " + std::to_string(i) + " of " + fileName);
+        }
+    }
+
+    // 从文件中读取index，数据损坏时抛出std::runtime_error
+    std::shared_ptr<const Index> loadIndex() const
+    {
+        uint64_t offset, size;
+        indexRegion(footer, offset, size);
+        std::vector<char> buf(size);
+        std::vector<BlockHandle> blocks;
+        readAt(buf.data(), size, offset);
+        if (!parseIndex(buf.data(), size, footer, header.kv_nums, blocks))
+        {
+            throw std::runtime_error("Corrupted index of " + fileName);
+        }
+        return std::make_shared<const Index>(std::move(blocks));
     }
 
 public:
-    std::vector<KOVPari> idx;
+    // 旧格式中数据区的起始位置
     const static uint32_t BASE = sizeof(Header) + BFSIZE / 8;
+    // 数据区每一项的固定部分：key(8) offset(8) vlen(4)，inline的value紧跟在后面
+    const static uint32_t ENTRYSIZE = 20;
+    const static uint32_t HANDLESIZE = 24;
+    const static uint32_t FOOTERSIZE = 40;
+    const static uint32_t OLDFOOTERSIZE = 24;
+    // 数据区切分为若干block，每个block不超过4kB(至少一项)
+    const static uint32_t BLOCKSIZE = 4096;
 
-    // 布隆过滤器
-    std::vector<bool> bloomFilter;
-    // 创建表 assignedTime是时间戳
-    SSTable(const std::vector<KOVPari> data,
-            int _level, int _id, std::vector<bool> bf, const uint64_t assignedTime)
-        : level(_level), id(_id), bloomFilter(bf), idx(data)
+    /* 创建表，数据block在查找时通过cache读取
+     * _index是从文件中读出的稀疏索引，为nullptr时第一次查找才根据footer读取，并放入indexCache */
+    SSTable(const Header &_header, int _level, int _id, std::unique_ptr<Filter> &&_filter,
+            std::shared_ptr<const Index> &&_index, const Footer &_footer, const std::string &_fileName,
+            Cache *_cache, IndexCache *_indexCache, FileCache *_fileCache)
+        : level(_level), id(_id), header(_header), index(std::move(_index)), footer(_footer), fileName(_fileName),
+          filter(std::move(_filter)), cacheId(nextCacheId()), cache(_cache), indexCache(_indexCache),
+          fileCache(_fileCache)
     {
-        header.time = assignedTime;
-        header.kv_nums = data.size();
-        if (!data.empty())
+    }
+
+    ~SSTable()
+    {
+        // 文件可能马上被删除，不要让缓存继续占用它
+        if (fileCache)
+        {
+            fileCache->erase(cacheId);
+        }
+    }
+
+    // 取得index，读取失败时抛出std::runtime_error
+    std::shared_ptr<const Index> getIndex() const
+    {
+        if (index)
+        {
+            return index;
+        }
+        std::shared_ptr<const Index> idx;
+        if (indexCache && (idx = indexCache->lookup(cacheId, 0)))
         {
-            header.minK = data.front().key;
-            header.maxK = data.back().key;
+            return idx;
         }
-        else
+        idx = loadIndex();
+        if (indexCache)
         {
-            std::cerr << "SSTable: data is empty" << std::endl;
-            header.minK = 0;
-            header.maxK = 0;
+            indexCache->insert(cacheId, 0, idx, idx->charge());
         }
+        return idx;
     }
 
-    ~SSTable() {}
+    /* 通过缓存读取index中的第i个block，读取失败时抛出std::runtime_error
+     * fillCache为false时不把读出的block放入缓存，用于合并时顺序读取整个SSTable */
+    std::shared_ptr<const Block> readBlock(const Index &idx, size_t i, bool fillCache = true) const
+    {
+        std::shared_ptr<const Block> block;
+        if (cache && (block = cache->lookup(cacheId, i)))
+        {
+            return block;
+        }
+        std::shared_ptr<Block> b = std::make_shared<Block>();
+        loadBlock(idx.blocks[i], i, *b);
+        if (cache && fillCache)
+        {
+            cache->insert(cacheId, i, b, b->charge());
+        }
+        return b;
+    }
 
     /* 查找key，如果没找到会返回false
-     * 找到会为offset和vlen写入对应的值，并返回true
+     * 找到会为offset和vlen写入对应的值，并返回true；value直接存放在SSTable中时同时取出value
+     * 读取文件失败时抛出std::runtime_error，不会当作没有找到
      */
-    bool get(uint64_t key, uint64_t &offset, uint32_t &vlen)
+    bool get(uint64_t key, uint64_t &offset, uint32_t &vlen, std::string &value)
     {
         if (key < header.minK || key > header.maxK)
         {
             return false;
         }
 
-        if (!findBloom(key))
+        if (!mayContain(key))
         {
             return false;
         }
 
-        uint64_t target = binarySearch(key);
-        if (target == UINT64_MAX)
+        std::shared_ptr<const Index> idx = getIndex();
+        std::shared_ptr<const Block> block = readBlock(*idx, idx->findBlock(key));
+        size_t i = block->lowerBound(key);
+        if (i == block->size() || block->keys[i] != key)
         {
             return false;
         }
 
-        offset = idx[target].offset;
-        vlen = idx[target].vlen;
+        offset = block->offsets[i];
+        vlen = block->vlens[i];
+        if (isInline(vlen))
+        {
+            value.assign(block->values, offset, valueLen(vlen));
+        }
         return true;
     }
 
-    bool findBloom(uint64_t &key)
+    static bool isInline(uint32_t vlen)
     {
-        uint32_t hash[4] = {0};
-        MurmurHash3_x64_128(&key, sizeof(key), 1, hash);
+        return vlen & INLINEFLAG;
+    }
 
-        if (bloomFilter[hash[0] % (BFSIZE)] == false)
-            return false;
-        if (bloomFilter[hash[1] % (BFSIZE)] == false)
-            return false;
-        if (bloomFilter[hash[2] % (BFSIZE)] == false)
-            return false;
-        if (bloomFilter[hash[3] % (BFSIZE)] == false)
-            return false;
+    static uint32_t valueLen(uint32_t vlen)
+    {
+        return vlen & ~INLINEFLAG;
+    }
 
+    // 一项在数据区中占用的字节数
+    static size_t entrySize(const KOVPari &p)
+    {
+        return ENTRYSIZE + (isInline(p.vlen) ? valueLen(p.vlen) : 0);
+    }
+
+    // 将一项编码到out末尾，inline的value从values中取出
+    static void encodeEntry(std::string &out, const KOVPari &p, const std::string &values)
+    {
+        out.append((const char *)&p.key, sizeof(p.key));
+        out.append((const char *)&p.offset, sizeof(p.offset));
+        out.append((const char *)&p.vlen, sizeof(p.vlen));
+        if (isInline(p.vlen))
+        {
+            out.append(values, p.offset, valueLen(p.vlen));
+        }
+    }
+
+    /* 解析数据区中的n项，对每一项调用visit(key, offset, vlen)
+     * inline的value追加到values末尾，并把offset改为在values中的位置
+     * 返回false表示数据不完整
+     */
+    template <typename Visit>
+    static bool parseEntries(const char *data, size_t size, uint64_t n, std::string &values, const Visit &visit)
+    {
+        size_t pos = 0;
+        uint64_t key;
+        uint64_t offset;
+        uint32_t vlen;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (pos + ENTRYSIZE > size)
+            {
+                return false;
+            }
+            std::memcpy(&key, data + pos, 8);
+            std::memcpy(&offset, data + pos + 8, 8);
+            std::memcpy(&vlen, data + pos + 16, sizeof(vlen));
+            pos += ENTRYSIZE;
+            if (isInline(vlen))
+            {
+                uint32_t len = valueLen(vlen);
+                if (pos + len > size)
+                {
+                    return false;
+                }
+                offset = values.size();
+                values.append(data + pos, len);
+                pos += len;
+            }
+            visit(key, offset, vlen);
+        }
         return true;
     }
 
+    // 解析为KOVPari数组，追加到out末尾
+    static bool decodeEntries(const char *data, size_t size, uint64_t n,
+                              std::vector<KOVPari> &out, std::string &values)
+    {
+        out.reserve(out.size() + n);
+        return parseEntries(data, size, n, values, [&out](uint64_t key, uint64_t offset, uint32_t vlen)
+                            { out.emplace_back(key, offset, vlen); });
+    }
+
+    // 解析一个数据block
+    static bool decodeBlock(const char *data, size_t size, uint64_t n, Block &block)
+    {
+        block.keys.reserve(n);
+        block.offsets.reserve(n);
+        block.vlens.reserve(n);
+        return parseEntries(data, size, n, block.values, [&block](uint64_t key, uint64_t offset, uint32_t vlen)
+                            {
+                                block.keys.push_back(key);
+                                block.offsets.push_back(offset);
+                                block.vlens.push_back(vlen); });
+    }
+
+    /* 把kovPairs编码为一个完整的SSTable，追加到out末尾，inline的value从values中取出
+     * 过滤器按policy生成 */
+    static void encodeTable(std::string &out, uint64_t time, const std::vector<KOVPari> &kovPairs,
+                            const std::string &values, const FilterPolicy &policy)
+    {
+        size_t start = out.size();
+        Header h{time, kovPairs.size(), kovPairs.front().key, kovPairs.back().key};
+        out.append((const char *)&h, sizeof(h));
+        std::vector<BlockHandle> handles;
+        std::vector<uint64_t> keys;
+        keys.reserve(kovPairs.size());
+        for (const KOVPari &p : kovPairs)
+        {
+            uint64_t pos = out.size() - start;
+            if (handles.empty() || (handles.back().size + entrySize(p) > BLOCKSIZE && handles.back().count > 0))
+            {
+                handles.push_back(BlockHandle{p.key, pos, 0, 0});
+            }
+            encodeEntry(out, p, values);
+            handles.back().size += out.size() - start - pos;
+            handles.back().count++;
+            keys.push_back(p.key);
+        }
+        Footer f;
+        f.filterOffset = out.size() - start;
+        Filter::build(policy, keys, out);
+        f.filterSize = out.size() - start - f.filterOffset;
+        f.filterType = policy.type;
+        f.indexOffset = out.size() - start;
+        for (const BlockHandle &b : handles)
+        {
+            out.append((const char *)&b.firstKey, 8);
+            out.append((const char *)&b.offset, 8);
+            out.append((const char *)&b.size, 4);
+            out.append((const char *)&b.count, 4);
+        }
+        f.blockNum = handles.size();
+        uint64_t magic = SSTMAGIC2;
+        uint32_t type = (uint32_t)f.filterType;
+        out.append((const char *)&f.filterOffset, 8);
+        out.append((const char *)&f.filterSize, 4);
+        out.append((const char *)&type, 4);
+        out.append((const char *)&f.indexOffset, 8);
+        out.append((const char *)&f.blockNum, 8);
+        out.append((const char *)&magic, 8);
+    }
+
+    /* encodeTable生成的文件的字节数：dataSize字节的数据区切分为blockNum个block，共keyNum个不同的key
+     * 过滤器按policy计算，XOR8生成失败时实际会更小 */
+    static size_t encodedSize(size_t dataSize, size_t blockNum, size_t keyNum, const FilterPolicy &policy)
+    {
+        return sizeof(Header) + dataSize + Filter::encodedSize(policy, keyNum) + blockNum * HANDLESIZE + FOOTERSIZE;
+    }
+
+    /* 读取文件末尾的footer，得到数据区、过滤器和index的位置
+     * 最早格式的文件没有footer，此时hasIndex为false，数据区一直到文件末尾 */
+    static Footer readFooter(std::istream &in, uint64_t fileSize)
+    {
+        Footer f;
+        f.dataOffset = BASE;
+        f.dataEnd = fileSize;
+        f.filterOffset = sizeof(Header);
+        f.filterSize = BFSIZE / 8;
+        f.filterType = FilterType::BLOOM;
+        f.indexOffset = fileSize;
+        f.blockNum = 0;
+        f.hasIndex = false;
+        f.fileSize = fileSize;
+
+        char footer[FOOTERSIZE];
+        uint64_t magic = 0;
+        if (fileSize >= sizeof(Header) + OLDFOOTERSIZE)
+        {
+            in.seekg(fileSize - 8);
+            in.read((char *)&magic, 8);
+        }
+        if (in && magic == SSTMAGIC && fileSize >= BASE + OLDFOOTERSIZE)
+        {
+            // 过滤器仍然是固定的Bloom Filter
+            in.seekg(fileSize - OLDFOOTERSIZE);
+            in.read(footer, OLDFOOTERSIZE);
+            uint64_t indexOffset, n;
+            std::memcpy(&indexOffset, footer, 8);
+            std::memcpy(&n, footer + 8, 8);
+            if (in && indexOffset >= BASE && indexOffset + n * HANDLESIZE + OLDFOOTERSIZE == fileSize)
+            {
+                f.dataEnd = f.indexOffset = indexOffset;
+                f.blockNum = n;
+                f.hasIndex = true;
+            }
+        }
+        else if (in && magic == SSTMAGIC2 && fileSize >= sizeof(Header) + FOOTERSIZE)
+        {
+            in.seekg(fileSize - FOOTERSIZE);
+            in.read(footer, FOOTERSIZE);
+            Footer g = f;
+            uint32_t type;
+            std::memcpy(&g.filterOffset, footer, 8);
+            std::memcpy(&g.filterSize, footer + 8, 4);
+            std::memcpy(&type, footer + 12, 4);
+            std::memcpy(&g.indexOffset, footer + 16, 8);
+            std::memcpy(&g.blockNum, footer + 24, 8);
+            g.filterType = (FilterType)type;
+            g.dataOffset = sizeof(Header);
+            g.dataEnd = g.filterOffset;
+            g.hasIndex = true;
+            if (in && g.filterOffset >= g.dataOffset && g.filterOffset + g.filterSize == g.indexOffset &&
+                g.indexOffset + g.blockNum * HANDLESIZE + FOOTERSIZE == fileSize)
+            {
+                f = g;
+            }
+        }
+        in.clear();
+        return f;
+    }
+
+    // 文件中需要读取的用于生成index的区域，最早格式的文件没有index，需要读取整个数据区
+    static void indexRegion(const Footer &f, uint64_t &offset, uint64_t &size)
+    {
+        offset = f.hasIndex ? f.indexOffset : f.dataOffset;
+        size = f.hasIndex ? f.blockNum * HANDLESIZE : f.dataEnd - f.dataOffset;
+    }
+
+    // 由indexRegion中的数据生成index，n是键值对的数量
+    static bool parseIndex(const char *data, size_t size, const Footer &f, uint64_t n, std::vector<BlockHandle> &out)
+    {
+        if (f.hasIndex)
+        {
+            decodeIndex(data, f.blockNum, out);
+            return true;
+        }
+        return buildIndex(data, size, n, f.dataOffset, out);
+    }
+
+    // 解析index中的n项
+    static void decodeIndex(const char *data, uint64_t n, std::vector<BlockHandle> &out)
+    {
+        out.resize(n);
+        for (uint64_t i = 0; i < n; i++, data += HANDLESIZE)
+        {
+            std::memcpy(&out[i].firstKey, data, 8);
+            std::memcpy(&out[i].offset, data + 8, 8);
+            std::memcpy(&out[i].size, data + 16, 4);
+            std::memcpy(&out[i].count, data + 20, 4);
+        }
+    }
+
+    /* 最早格式的文件没有index，按照encodeTable相同的规则把从base开始的数据区切分为block
+     * 返回false表示数据不完整 */
+    static bool buildIndex(const char *data, size_t size, uint64_t n, uint64_t base, std::vector<BlockHandle> &out)
+    {
+        size_t pos = 0;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (pos + ENTRYSIZE > size)
+            {
+                return false;
+            }
+            uint64_t key;
+            uint32_t vlen;
+            std::memcpy(&key, data + pos, 8);
+            std::memcpy(&vlen, data + pos + 16, 4);
+            size_t len = ENTRYSIZE + (isInline(vlen) ? valueLen(vlen) : 0);
+            if (pos + len > size)
+            {
+                return false;
+            }
+            if (out.empty() || (out.back().size + len > BLOCKSIZE && out.back().count > 0))
+            {
+                out.push_back(BlockHandle{key, base + pos, 0, 0});
+            }
+            out.back().size += len;
+            out.back().count++;
+            pos += len;
+        }
+        return true;
+    }
+
+    bool mayContain(uint64_t key) const
+    {
+        return !filter || filter->mayContain(key);
+    }
+
     uint64_t getTime() const
     {
         return header.time;
@@ -150,6 +603,15 @@ public:
     {
         return header.kv_nums;
     }
+    // 文件的字节数
+    uint64_t fileBytes() const
+    {
+        return footer.fileSize;
+    }
+    const std::string &getFileName() const
+    {
+        return fileName;
+    }
     int getLevel() const
     {
         return level;
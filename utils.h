@@ -9,6 +9,10 @@
 #include <fcntl.h>
 #include <cstring>
 #include <memory>
+#include <cstdint>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define PAGE_SIZE (4 * 1024)
 
@@ -103,6 +107,25 @@ namespace utils
         return ::unlink(path.c_str());
     }
 
+    /**
+     * Flush the directory entry of a file, call it after creating or renaming the file
+     * @param path the file whose parent directory is synced.
+     * @return true if the directory is synced successfully.
+     */
+    static inline bool syncDir(const std::string &path)
+    {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
     /**
      * Reclaim space of a file
      * @param path file to be reclaimed.
@@ -186,17 +209,137 @@ namespace utils
     /**
      * generate crc16
      * @param data binary data used to generate crc16.
+     * @param length number of bytes in data.
+     * @param crc result of the previous part when computing in pieces.
      * @return generated crc16.
      */
-    static inline uint16_t crc16(const std::vector<unsigned char> &data)
+    static inline uint16_t crc16(const unsigned char *data, size_t length, uint16_t crc = 0xFFFF)
     {
         static const std::unique_ptr<uint16_t[]> crc16_table = generate_crc16_table();
-        uint16_t crc = 0xFFFF;
-        size_t i = 0, length = data.size();
+        size_t i = 0;
         while (i < length)
         {
             crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i++]) & 0xFF];
         }
         return crc;
     }
+
+    /**
+     * generate crc16
+     * @param data binary data used to generate crc16.
+     * @return generated crc16.
+     */
+    static inline uint16_t crc16(const std::vector<unsigned char> &data)
+    {
+        return crc16(data.data(), data.size());
+    }
+
+    /**
+     * util function used by crc32c, you needn't call this function yourself
+     * table[k * 256 + i] is the crc of byte i followed by k zero bytes, used by slicing-by-8
+     */
+#define CRC32C_POLY 0x82F63B78
+    static inline std::unique_ptr<uint32_t[]> generate_crc32c_table()
+    {
+        std::unique_ptr<uint32_t[]> table(new uint32_t[8 * 256]);
+        for (int i = 0; i < 256; i++)
+        {
+            uint32_t value = i;
+            for (int j = 0; j < 8; j++)
+            {
+                value = (value & 1) ? (value >> 1) ^ CRC32C_POLY : value >> 1;
+            }
+            table[i] = value;
+        }
+        for (int k = 1; k < 8; k++)
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                uint32_t prev = table[(k - 1) * 256 + i];
+                table[k * 256 + i] = (prev >> 8) ^ table[prev & 0xFF];
+            }
+        }
+        return table;
+    }
+
+    /**
+     * portable crc32c, 8 bytes per step (slicing-by-8), little endian only
+     */
+    static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t length)
+    {
+        static const std::unique_ptr<uint32_t[]> table = generate_crc32c_table();
+        const uint32_t *t = table.get();
+        while (length > 0 && ((uintptr_t)p & 7))
+        {
+            crc = t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+            length--;
+        }
+        while (length >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            word ^= crc;
+            crc = t[7 * 256 + (word & 0xFF)] ^ t[6 * 256 + ((word >> 8) & 0xFF)] ^
+                  t[5 * 256 + ((word >> 16) & 0xFF)] ^ t[4 * 256 + ((word >> 24) & 0xFF)] ^
+                  t[3 * 256 + ((word >> 32) & 0xFF)] ^ t[2 * 256 + ((word >> 40) & 0xFF)] ^
+                  t[1 * 256 + ((word >> 48) & 0xFF)] ^ t[(word >> 56) & 0xFF];
+            p += 8;
+            length -= 8;
+        }
+        while (length-- > 0)
+        {
+            crc = t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    /**
+     * crc32c with the SSE4.2 crc32 instruction, only called when the cpu supports it
+     */
+    __attribute__((target("sse4.2"))) static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+    {
+        while (length > 0 && ((uintptr_t)p & 7))
+        {
+            crc = _mm_crc32_u8(crc, *p++);
+            length--;
+        }
+        uint64_t crc64 = crc;
+        while (length >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+            p += 8;
+            length -= 8;
+        }
+        crc = (uint32_t)crc64;
+        while (length-- > 0)
+        {
+            crc = _mm_crc32_u8(crc, *p++);
+        }
+        return crc;
+    }
+#endif
+
+    /**
+     * generate crc32c (Castagnoli), uses SSE4.2 when available
+     * @param crc result of the previous part, 0 for the first part:
+     *        crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m)
+     * @param data binary data used to generate crc32c.
+     * @param length number of bytes in data.
+     * @return generated crc32c.
+     */
+    static inline uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+        static const bool hasSSE42 = __builtin_cpu_supports("sse4.2");
+        if (hasSSE42)
+        {
+            return ~crc32c_hw(~crc, p, length);
+        }
+#endif
+        return ~crc32c_sw(~crc, p, length);
+    }
 }
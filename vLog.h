@@ -5,227 +5,820 @@
 #include <vector>
 #include <fstream>
 #include <utility>
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <climits>
 #include "utils.h"
 #include "ssTable.h"
 #include "vLogEntry.h"
+#include "LZCodec.h"
 
 #define MAGIC 0xff
-#define ENTRYOFFSET (15)
+/* 超级块：head(8) | tail(8) | segment数量(4) | 每个segment：begin(8) end(8) dead(8) reclaimed(1) | CheckSum(4)
+ * 旧版本的超级块只有 head(8) | tail(8) | CheckSum(2)，共18字节 */
+#define OLDSUPERSIZE 18
+#define SEGMENTMETASIZE 25
+/* 一个segment写满之后开始新的segment */
+#define SEGMENTSIZE (16 * 1024 * 1024)
+/* 删除标记"~DELETED~"的长度 */
+#define DELETEDLEN 9
 
 class vLog
 {
+public:
+    /* vLog在逻辑上划分为若干segment，每个segment是文件中一段连续的entry
+     * dead是segment中已经失效的字节数，合并SSTable丢弃旧版本时累加，gc优先回收dead最多的segment
+     * 回收后的segment变成文件中的空洞，reclaimed为true */
+    struct Segment
+    {
+        uint64_t begin;
+        uint64_t end;
+        uint64_t dead;
+        bool reclaimed;
+    };
+
 private:
     // 输入的文件名，就为“./data/vLog”
     std::string fileName;
+    // 长期持有的文件描述符，读操作都通过pread完成，可以被多个线程并发调用
+    int fd = -1;
     /* head就是当前文件的大小 */
-    uint32_t head = 0;
-    /* tail是从头找到第一个magic，之后进行crc校验，校验通过则这个magic的位置就是tail */
-    uint32_t tail = 0;
-
-    // 初始化，扫描文件
-    void init(std::string &_filename)
+    uint64_t head = 0;
+    /* tail记录在超级块中，超级块失效时从头找到第一个magic，之后进行crc校验，校验通过则这个magic的位置就是tail */
+    uint64_t tail = 0;
+    /* tail之后的所有segment，以begin为键 */
+    std::map<uint64_t, Segment> segments;
+    /* 新写入的entry的magic，决定使用的校验和 */
+    uint8_t magic;
+    /* 新写入的value是否压缩，压缩后没有变小的value仍然按原样写入 */
+    CompressionType compression;
+
+    /* mmap模式下只读映射整个文件，读操作直接从映射中拷贝
+     * 文件增长超过映射范围时按MAPCHUNK扩大映射
+     * 写入(以及随之的重新映射)时调用者持有diskMutex的独占锁，不会有读者还在使用旧的映射 */
+    const static size_t MAPCHUNK = 64 * 1024 * 1024;
+    bool useMmap;
+    char *mapBase = nullptr;
+    size_t mapSize = 0;
+
+    // 保证[0, head)都在映射范围内
+    void remap()
     {
-        std::fstream fs(_filename, std::ios::in | std::ios::binary);
-        if (!fs.is_open())
+        if (!useMmap || fd < 0 || head <= mapSize)
         {
-           // std::cerr << "Error: Failed to open vLog file." << std::endl;
             return;
         }
-        // Get the size of the file (head)
-        fs.seekg(0, std::ios::end);
-        head = fs.tellg();
-        if (head == 0)
+        size_t newSize = std::max<size_t>(mapSize * 2, ((size_t)head + MAPCHUNK - 1) / MAPCHUNK * MAPCHUNK);
+        void *p = mmap(nullptr, newSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
         {
+            perror("mmap vLog");
             return;
         }
+        if (mapBase)
+        {
+            munmap(mapBase, mapSize);
+        }
+        mapBase = static_cast<char *>(p);
+        mapSize = newSize;
+    }
 
-        // Start scanning from the beginning to find the tail
-        uint64_t current_pos = utils::seek_data_block(fileName);
-        fs.seekg(current_pos);
-        bool found_magic = false;
-        while (current_pos < this->head)
+    void unmapAll()
+    {
+        if (mapBase)
+        {
+            munmap(mapBase, mapSize);
+        }
+        mapBase = nullptr;
+        mapSize = 0;
+    }
+
+    bool openFile(bool create)
+    {
+        if (fd >= 0)
+        {
+            return true;
+        }
+        fd = open(fileName.c_str(), create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+        return fd >= 0;
+    }
+
+    void closeFile()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // 超级块保存在vLog文件旁边
+    std::string superName() const
+    {
+        return fileName + ".super";
+    }
+
+    /* 从超级块恢复tail和segment，需要满足：
+     * 校验和正确；记录的head不超过文件大小；tail处是一个完整的entry
+     * 超级块之后追加的数据归入最后一个segment */
+    bool loadSuper()
+    {
+        std::ifstream in(superName(), std::ios::binary);
+        std::string buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        uint64_t h, t;
+        uint32_t n = 0;
+        if (buf.size() == OLDSUPERSIZE)
+        {
+            uint16_t checkSum;
+            std::memcpy(&checkSum, buf.data() + 16, 2);
+            if (utils::crc16((const unsigned char *)buf.data(), 16) != checkSum)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            uint32_t checkSum;
+            if (buf.size() < 24)
+            {
+                return false;
+            }
+            std::memcpy(&checkSum, buf.data() + buf.size() - 4, 4);
+            std::memcpy(&n, buf.data() + 16, 4);
+            if (utils::crc32c(0, buf.data(), buf.size() - 4) != checkSum ||
+                buf.size() != 24 + (size_t)n * SEGMENTMETASIZE)
+            {
+                return false;
+            }
+        }
+        std::memcpy(&h, buf.data(), 8);
+        std::memcpy(&t, buf.data() + 8, 8);
+        if (h > head || t > h || (t < head && !checkCrc(t)))
+        {
+            return false;
+        }
+        tail = t;
+        if (buf.size() == OLDSUPERSIZE)
+        {
+            rebuildSegments();
+            return true;
+        }
+        segments.clear();
+        const char *p = buf.data() + 20;
+        for (uint32_t i = 0; i < n; i++, p += SEGMENTMETASIZE)
+        {
+            Segment seg;
+            std::memcpy(&seg.begin, p, 8);
+            std::memcpy(&seg.end, p + 8, 8);
+            std::memcpy(&seg.dead, p + 16, 8);
+            seg.reclaimed = p[24];
+            segments[seg.begin] = seg;
+        }
+        if (head > h)
+        {
+            if (!segments.empty() && !segments.rbegin()->second.reclaimed && segments.rbegin()->second.end == h)
+            {
+                segments.rbegin()->second.end = head;
+            }
+            else
+            {
+                segments[h] = Segment{h, head, 0, false};
+            }
+        }
+        return true;
+    }
+
+    // 记录位于offset、长度为len的entry，当前segment写满时开始新的segment，返回是否新建了segment
+    bool addEntry(uint64_t offset, uint64_t len)
+    {
+        if (!segments.empty())
         {
-            // Read the magic byte
-            uint8_t byte;
-            fs.read(reinterpret_cast<char *>(&byte), sizeof(byte));
+            Segment &last = segments.rbegin()->second;
+            if (!last.reclaimed && last.end - last.begin < SEGMENTSIZE)
+            {
+                last.end = offset + len;
+                return false;
+            }
+        }
+        segments[offset] = Segment{offset, offset + len, 0, false};
+        return true;
+    }
 
-            if (byte == MAGIC)
+    /* 超级块中没有segment时，从tail开始逐个读取entry的header重新划分segment
+     * 遇到空洞或者不完整的entry时找到下一个完整的entry，中间的区域视为已经回收；失效字节数无法恢复，记为0 */
+    void rebuildSegments()
+    {
+        segments.clear();
+        uint64_t pos = tail;
+        char header[MAXENTRYOFFSET];
+        while (pos < head)
+        {
+            uint32_t checkSum, vlen = 0;
+            uint64_t key;
+            size_t headerLen = 0;
+            bool ok = readHeader(pos, header);
+            if (ok)
             {
-                uint16_t checksum;
-                fs.read(reinterpret_cast<char *>(&checksum), sizeof(checksum)); // Read checksum
+                headerLen = vLogEntry::decodeHeader(header, checkSum, key, vlen);
+                ok = pos + headerLen + vlen + 1 <= head;
+            }
+            if (!ok)
+            {
+                uint64_t next = scanTail(pos + 1);
+                segments[pos] = Segment{pos, next, next - pos, true};
+                pos = next;
+                continue;
+            }
+            addEntry(pos, headerLen + vlen + 1);
+            pos += headerLen + vlen + 1;
+        }
+    }
 
-                if (checkCrc(current_pos))
-                {
-                    tail = current_pos; // Set the tail position
-                    found_magic = true;
-                    break;
-                }
-                else
+    // 从from开始寻找第一个完整的entry，找不到返回head
+    uint64_t scanTail(uint64_t from)
+    {
+        // 跳过gc打出的空洞
+        off_t dataPos = lseek(fd, from, SEEK_DATA);
+        uint64_t current_pos = dataPos < 0 ? head : dataPos;
+        // 分块读取，在块内逐字节查找magic
+        std::vector<char> block(16 * PAGE_SIZE);
+        while (current_pos < this->head)
+        {
+            ssize_t n = pread(fd, block.data(), block.size(), current_pos);
+            if (n <= 0)
+            {
+                break;
+            }
+            for (ssize_t i = 0; i < n; i++)
+            {
+                if (ISMAGIC(block[i]) && checkCrc(current_pos + i))
                 {
-                    fs.seekg(-2, std::ios::cur);
+                    return current_pos + i;
                 }
             }
+            current_pos += n;
+        }
+        // 没有找到有效的entry，说明所有数据都已经被回收
+        return head;
+    }
 
-            current_pos++;
+    // 初始化，优先读取超级块，失败时扫描文件
+    void init()
+    {
+        head = tail = 0;
+        if (!openFile(false))
+        {
+           // std::cerr << "Error: Failed to open vLog file." << std::endl;
+            return;
         }
+        // Get the size of the file (head)
+        struct stat st;
+        fstat(fd, &st);
+        head = st.st_size;
+        if (head == 0)
+        {
+            return;
+        }
+        remap();
 
-        // if (!found_magic)
-        // {
-        //     // 文件有大小却没有合适的value
-        //     tail = head = 0;
-        //     utils::rmfile(fileName);
-        // }
+        if (loadSuper())
+        {
+            return;
+        }
+        tail = scanTail(0);
+        rebuildSegments();
+        saveSuper();
+    }
 
-        fs.close();
+    /* 读取pos处entry的header到header中，header至少要有MAXENTRYOFFSET字节
+     * 先读取较短的CRC16 header，magic表明是CRC32C时再读取剩下的部分 */
+    bool readHeader(uint64_t pos, char *header)
+    {
+        if (pos + ENTRYOFFSET > head || !read(pos, header, ENTRYOFFSET) || !ISMAGIC(header[0]))
+        {
+            return false;
+        }
+        size_t size = vLogEntry::headerSize(header[0]);
+        return size == ENTRYOFFSET ||
+               (pos + size <= head && read(pos + ENTRYOFFSET, header + ENTRYOFFSET, size - ENTRYOFFSET));
     }
 
     /* Magic和checksum在读取数据时检查数据是否被完整写入 */
     bool checkCrc(uint64_t pos)
     {
-        // 设置读取的位置
-        std::ifstream file(fileName, std::ios::binary);
-        file.seekg(pos);
-        uint8_t Magic;
-        uint16_t CheckSum;
+        char header[MAXENTRYOFFSET];
+        if (!readHeader(pos, header))
+        {
+            return false;
+        }
+        uint8_t Magic = header[0];
+        uint32_t CheckSum;
         uint64_t Key;
         uint32_t vlen;
-        std::string Value;
-        file.read((char *)&Magic, 1);
-        file.read((char *)&CheckSum, 2);
-        file.read((char *)&Key, 8);
-        file.read((char *)&vlen, 4);
-        // 读取 value 到临时缓冲区
-        std::vector<char> temp(vlen);
-        file.read(temp.data(), vlen);
-
-        // 将临时缓冲区中的数据转换为 std::string
-        Value.assign(temp.data(), temp.size());
+        size_t headerLen = vLogEntry::decodeHeader(header, CheckSum, Key, vlen);
+        if (pos + headerLen + vlen > head)
+        {
+            return false;
+        }
+        // 读取 value
+        std::string Value(vlen, '\0');
+        if (!read(pos + headerLen, &Value[0], vlen))
+        {
+            return false;
+        }
 
-        uint16_t checksum = generateCheckSum(Key, vlen, Value);
-        file.close();
-        return CheckSum == checksum;
+        if (CheckSum != vLogEntry::checksum(Magic, Key, vlen, Value.data()))
+        {
+            return false;
+        }
+        std::string raw;
+        return !ISCOMPRESSED(Magic) || decodeValue(Magic, Value.data(), vlen, raw);
     }
 
-public:
-    // 构造函数，如果已经有曾经的文件，则读取这个文件，如果还没有文件就创建一个新文件
-    vLog(const std::string &_fileName) : fileName(_fileName)
+    /* 把iov中的内容写入pos处，每次最多提交IOV_MAX项，处理只写入了一部分的情况 */
+    bool writeVec(std::vector<struct iovec> &iov, uint64_t pos)
     {
-        init(fileName);
+        size_t i = 0;
+        while (i < iov.size())
+        {
+            ssize_t n = pwritev(fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX), pos);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                perror("write vLog");
+                return false;
+            }
+            pos += n;
+            // 跳过已经写完的项
+            while (i < iov.size() && (size_t)n >= iov[i].iov_len)
+            {
+                n -= iov[i].iov_len;
+                i++;
+            }
+            if (n > 0)
+            {
+                iov[i].iov_base = (char *)iov[i].iov_base + n;
+                iov[i].iov_len -= n;
+            }
+        }
+        return true;
     }
-    ~vLog() {}
 
-    uint32_t getHead()
+    /* 依次写入forEach给出的最多count个KV，forEach(visit)对每个KV调用visit(key, value, vlen)
+     * 同一遍中生成kovPairs。每个entry的header放在headers中，value直接引用调用者的内存，
+     * 一个entry对应两项iovec：上一个entry末尾的\0和header | value */
+    template <typename ForEach>
+    void putEntries(size_t count, const ForEach &forEach, std::vector<SSTable::KOVPari> &kovPairs,
+                    uint32_t inlineThreshold, std::string &inlineValues)
     {
-        return this->head;
+        kovPairs.clear();
+        kovPairs.reserve(count);
+        inlineValues.clear();
+        // 打开vLog文件以进行写入
+        if (!openFile(true))
+        {
+            std::cerr << "Error: Failed to open vLog file for writing." << std::endl;
+            return;
+        }
+
+        uint64_t currentOffset = head;
+        bool newSegment = false;
+        // 第i个entry的header在headers[stride * i + 1]处，前一个字节是上一个entry末尾的\0
+        const size_t stride = MAXENTRYOFFSET + 1;
+        std::vector<char> headers(stride * count + 1, 0);
+        std::vector<struct iovec> iov;
+        iov.reserve(2 * count + 1);
+        size_t written = 0;
+        // 压缩后的value，预留空间保证string不会移动
+        std::vector<std::string> compressed;
+        if (compression == CompressionType::LZ)
+        {
+            compressed.reserve(count);
+        }
+
+        forEach([&](uint64_t key, const char *value, uint32_t vlen)
+                {
+            // 注意这里的value有可能是DELETED
+            if (vlen == DELETEDLEN && std::memcmp(value, "~DELETED~", DELETEDLEN) == 0)
+            {
+                // 不写入文件，但是要搞成vlen = 0 的KOVPair
+                kovPairs.emplace_back(key, currentOffset, 0);
+                return;
+            }
+            if (vlen < inlineThreshold)
+            {
+                kovPairs.emplace_back(key, inlineValues.size(), vlen | INLINEFLAG);
+                inlineValues.append(value, vlen);
+                return;
+            }
+
+            uint8_t entryMagic = magic;
+            if (compression == CompressionType::LZ)
+            {
+                std::string &c = compressed.emplace_back((const char *)&vlen, sizeof(vlen));
+                LZCodec::compress(value, vlen, c);
+                if (c.size() < vlen)
+                {
+                    entryMagic &= ~MAGIC_LZ;
+                    value = c.data();
+                    vlen = c.size();
+                }
+            }
+
+            char *header = headers.data() + stride * written + 1;
+            size_t headerLen = vLogEntry::encodeHeader(header, entryMagic, key, vlen, value);
+            if (written == 0)
+            {
+                iov.push_back({header, headerLen});
+            }
+            else
+            {
+                iov.push_back({header - 1, headerLen + 1});
+            }
+            if (vlen > 0)
+            {
+                iov.push_back({(void *)value, vlen});
+            }
+            written++;
+
+            // 构造KOVPair并添加到返回的向量中，vlen是value在文件中的长度
+            size_t entryL = headerLen + vlen + 1;
+            kovPairs.emplace_back(key, currentOffset, vlen);
+            newSegment |= addEntry(currentOffset, entryL);
+            currentOffset += entryL; });
+
+        if (written > 0)
+        {
+            // 最后一个entry末尾的\0
+            iov.push_back({headers.data() + stride * written, 1});
+        }
+        if (!writeVec(iov, head))
+        {
+            return;
+        }
+
+        // 更新头部指针
+        head = currentOffset;
+        remap();
+        // 超级块只在开始新的segment时更新，之后追加的数据在启动时归入最后一个segment
+        if (newSegment)
+        {
+            saveSuper();
+        }
     }
 
-    uint32_t getTail()
+public:
+    // 构造函数，如果已经有曾经的文件，则读取这个文件，如果还没有文件就在第一次写入时创建
+    vLog(const std::string &_fileName, bool _useMmap = false, ChecksumType checksum = ChecksumType::CRC32C,
+         CompressionType _compression = CompressionType::NONE)
+        : fileName(_fileName), magic(vLogEntry::magicOf(checksum)), compression(_compression), useMmap(_useMmap)
     {
-        return this->tail;
+        init();
     }
-
-    uint32_t updateTail()
+    ~vLog()
     {
-        init(this->fileName);
+        if (fd >= 0)
+        {
+            saveSuper(); // 保存最新的失效字节数
+        }
+        unmapAll();
+        closeFile();
     }
 
-    /* 在LSMTree get操作中，如果找到了，则通过this->get函数拿取value */
-    bool get(std::string &value, uint64_t offset, uint32_t vlen)
+    /* 把文件中vlen字节的value还原为原始的value，压缩的value先解压
+     * 压缩的value：原始长度(4) | LZ压缩的数据 */
+    static bool decodeValue(uint8_t magic, const char *data, uint32_t vlen, std::string &value)
     {
-        std::ifstream fs(fileName, std::ios::binary);
-        if (!fs.is_open())
+        if (!ISCOMPRESSED(magic))
+        {
+            value.assign(data, vlen);
+            return true;
+        }
+        uint32_t rawLen;
+        if (vlen < sizeof(rawLen))
         {
-            std::cerr << "Error: Failed to open vLog file to get data." << std::endl;
             return false;
         }
+        std::memcpy(&rawLen, data, sizeof(rawLen));
+        value.resize(rawLen);
+        return LZCodec::decompress(data + sizeof(rawLen), vlen - sizeof(rawLen), &value[0], rawLen);
+    }
 
-        if(offset < tail)
+    uint64_t getHead()
+    {
+        return this->head;
+    }
+
+    uint64_t getTail()
+    {
+        return this->tail;
+    }
+
+    // 把写入的entry刷到磁盘，在引用它们的SSTable生效之前调用
+    bool sync()
+    {
+        if (fd >= 0 && fdatasync(fd) != 0)
         {
+            perror("fdatasync vlog");
             return false;
         }
-
-        fs.seekg(offset + ENTRYOFFSET);
-        value.resize(vlen);       // Resize the string to accommodate vlen
-        fs.read(&value[0], vlen); // Read directly into the string buffer
-        fs.close();
         return true;
     }
 
-    /* 将内存中的KV储存到vLog，然后返回对应的一系列KOVpari，之后就可以生成SSTable保存在Level0 */
-    void put(MemTable &memTable, std::vector<SSTable::KOVPari> &kovPairs)
+    /* 把head、tail和segment写入超级块，先写临时文件并刷盘再rename，最后刷新目录项
+     * 保证崩溃后超级块要么是旧的要么是新的，不会因为目录项没有落盘而丢失 */
+    void saveSuper()
     {
-        kovPairs.clear();
-        // 打开vLog文件以进行写入
-        std::ofstream file(fileName, std::ios::binary | std::ios::app);
-        if (!file.is_open())
+        std::string buf;
+        uint64_t h = head;
+        uint64_t t = tail;
+        uint32_t n = segments.size();
+        buf.reserve(24 + (size_t)n * SEGMENTMETASIZE);
+        buf.append((const char *)&h, 8);
+        buf.append((const char *)&t, 8);
+        buf.append((const char *)&n, 4);
+        for (const auto &it : segments)
         {
-            std::cerr << "Error: Failed to open vLog file for writing." << std::endl;
+            const Segment &seg = it.second;
+            buf.append((const char *)&seg.begin, 8);
+            buf.append((const char *)&seg.end, 8);
+            buf.append((const char *)&seg.dead, 8);
+            buf.push_back(seg.reclaimed ? 1 : 0);
+        }
+        uint32_t checkSum = utils::crc32c(0, buf.data(), buf.size());
+        buf.append((const char *)&checkSum, 4);
+        std::string tmpName = superName() + ".tmp";
+        int f = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = f >= 0 && write(f, buf.data(), buf.size()) == (ssize_t)buf.size() && fdatasync(f) == 0;
+        if (f >= 0)
+        {
+            close(f);
+        }
+        if (!ok || std::rename(tmpName.c_str(), superName().c_str()) != 0)
+        {
+            std::cerr << "Error: Failed to write vLog superblock." << std::endl;
+            utils::rmfile(tmpName);
             return;
         }
+        if (!utils::syncDir(superName()))
+        {
+            perror("fsync vLog dir");
+        }
+    }
 
-        uint64_t currentOffset = head;
-
-        // 将MemTable中的每个条目写入到vLog文件中
-        std::vector<vLogEntry> entrys;
-        memTable.getAllNodes(entrys);
-        // 使用流缓冲区来提高写入性能
-        std::ostringstream buffer;
+    // 合并SSTable时丢弃了offset处的旧版本，计入所在segment的失效字节数
+    void markDead(uint64_t offset, uint32_t vlen)
+    {
+        if (offset < tail)
+        {
+            return;
+        }
+        auto it = segments.upper_bound(offset);
+        if (it == segments.begin())
+        {
+            return;
+        }
+        Segment &seg = std::prev(it)->second;
+        if (!seg.reclaimed && offset < seg.end)
+        {
+            // 不知道entry的magic，header按当前写入的格式计算
+            seg.dead = std::min<uint64_t>(seg.end - seg.begin, seg.dead + vLogEntry::headerSize(magic) + vlen + 1);
+        }
+    }
 
-        // 注意这里的vLogEntry里面的value有可能是DELETED
-        for (const vLogEntry &entry : entrys)
+    /* 按失效字节数从多到少选出若干segment，总大小达到chunk_size为止
+     * 正在写入的最后一个segment和tail所在的segment不参与 */
+    std::vector<Segment> pickSegments(uint64_t chunk_size)
+    {
+        std::vector<Segment> candidates;
+        for (const auto &it : segments)
         {
-            if (entry.Value == "~DELETED~")
+            const Segment &seg = it.second;
+            if (seg.reclaimed || seg.dead == 0 || seg.begin < tail || seg.begin == segments.rbegin()->first)
             {
-                // 不写入文件，但是要搞成vlen = 0 的KOVPair
-                kovPairs.emplace_back(entry.Key, currentOffset, 0);
                 continue;
             }
+            candidates.push_back(seg);
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Segment &a, const Segment &b)
+                  { return a.dead > b.dead; });
+        uint64_t total = 0;
+        size_t n = 0;
+        while (n < candidates.size() && total < chunk_size)
+        {
+            total += candidates[n].end - candidates[n].begin;
+            n++;
+        }
+        candidates.resize(n);
+        return candidates;
+    }
 
-            size_t entryL = ENTRYOFFSET + entry.vlen + 1;
-
-            buffer.write((char *)(&entry.Magic), sizeof(entry.Magic));
-            buffer.write((char *)(&entry.CheckSum), sizeof(entry.CheckSum));
-            buffer.write((char *)(&entry.Key), sizeof(entry.Key));
-            buffer.write((char *)(&entry.vlen), sizeof(entry.vlen));
-            buffer.write((char *)(entry.Value.c_str()), entry.vlen + 1); // 需要注意Value有自带的\0
+    // segment中有效的value都已经搬走，回收整个segment的磁盘空间
+    void reclaimSegment(uint64_t begin)
+    {
+        auto it = segments.find(begin);
+        if (it == segments.end() || it->second.reclaimed)
+        {
+            return;
+        }
+        Segment &seg = it->second;
+        // 不对齐到页，两端所在的页中属于相邻segment的数据不能被清零
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, seg.begin, seg.end - seg.begin) < 0)
+        {
+            perror("fallocate");
+            return;
+        }
+        seg.reclaimed = true;
+        seg.dead = seg.end - seg.begin;
+        saveSuper();
+    }
 
-            // 构造KOVPair并添加到返回的向量中
-            kovPairs.emplace_back(entry.Key, currentOffset, entry.vlen);
+    // 未回收的segment中失效数据的比例
+    double garbageRatio()
+    {
+        uint64_t total = 0;
+        uint64_t dead = 0;
+        for (const auto &it : segments)
+        {
+            if (!it.second.reclaimed)
+            {
+                total += it.second.end - it.second.begin;
+                dead += it.second.dead;
+            }
+        }
+        return total == 0 ? 0 : (double)dead / total;
+    }
 
-            // 更新当前偏移量
-            currentOffset += entryL;
+    // pos是已回收segment的起点时，返回之后第一个没有回收的位置
+    uint64_t skipReclaimed(uint64_t pos)
+    {
+        for (auto it = segments.find(pos); it != segments.end() && it->second.reclaimed; it = segments.find(pos))
+        {
+            pos = it->second.end;
         }
-        file << buffer.str();
+        return pos;
+    }
 
-        // 关闭文件
-        file.close();
+    // pos之后第一个已回收segment的起点，没有则返回head
+    uint64_t nextReclaimed(uint64_t pos)
+    {
+        for (auto it = segments.upper_bound(pos); it != segments.end(); ++it)
+        {
+            if (it->second.reclaimed)
+            {
+                return it->first;
+            }
+        }
+        return head;
+    }
 
-        // 更新头部指针
-        head = currentOffset;
+    /* gc回收[tail, newTail)之后调用，newTail一般是一个entry的起始位置
+     * 如果不是完整的entry就向后扫描，然后更新超级块 */
+    uint64_t setTail(uint64_t newTail)
+    {
+        tail = newTail;
+        if (tail < head && !checkCrc(tail))
+        {
+            tail = scanTail(tail);
+        }
+        // tail之前的segment已经全部回收
+        while (!segments.empty() && segments.begin()->second.end <= tail)
+        {
+            segments.erase(segments.begin());
+        }
+        saveSuper();
+        return this->tail;
+    }
 
-        return;
+    /* 从offset处读取len字节到buf，读不满返回false */
+    bool read(uint64_t offset, char *buf, size_t len)
+    {
+        if (fd < 0)
+        {
+            return false;
+        }
+        if (mapBase && offset + len <= head)
+        {
+            std::memcpy(buf, mapBase + offset, len);
+            return true;
+        }
+        while (len > 0)
+        {
+            ssize_t n = pread(fd, buf, len, offset);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            buf += n;
+            offset += n;
+            len -= n;
+        }
+        return true;
     }
 
-    void reset()
+    /* 回收[offset, offset + len)的磁盘空间，文件的逻辑大小不变 */
+    int punchHole(off_t offset, off_t len)
     {
-        head = tail = 0;
-        utils::rmfile(fileName);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        len += offset % PAGE_SIZE;
+        offset = offset / PAGE_SIZE * PAGE_SIZE;
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0)
+        {
+            perror("fallocate");
+            return -2;
+        }
+        return 0;
     }
 
-    uint16_t generateCheckSum(uint64_t &key, uint32_t &vlen, const std::string &value)
+    /* 在LSMTree get操作中，如果找到了，则通过this->get函数拿取value */
+    bool get(std::string &value, uint64_t offset, uint32_t vlen)
     {
-        std::vector<unsigned char> data(sizeof(key) + sizeof(vlen) + vlen);
+        if (fd < 0)
+        {
+            std::cerr << "Error: Failed to open vLog file to get data." << std::endl;
+            return false;
+        }
 
-        // 拷贝 key 到 data
-        std::memcpy(data.data(), &key, sizeof(key));
+        if(offset < tail)
+        {
+            return false;
+        }
 
-        // 拷贝 vlen 到 data
-        std::memcpy(data.data() + sizeof(key), &vlen, sizeof(vlen));
+        /* 连同header一起读取，由magic判断header的长度以及value是否压缩
+         * 按较长的header读取，CRC16的entry多读的部分是末尾的\0和下一个entry，不会超过head */
+        if (offset + ENTRYOFFSET + vlen > head)
+        {
+            return false;
+        }
+        size_t len = std::min<uint64_t>(MAXENTRYOFFSET + vlen, head - offset);
+        value.resize(len);
+        if (!read(offset, &value[0], len) || !ISMAGIC(value[0]))
+        {
+            return false;
+        }
+        size_t headerLen = vLogEntry::headerSize(value[0]);
+        if (headerLen + vlen > len)
+        {
+            return false;
+        }
+        if (ISCOMPRESSED(value[0]))
+        {
+            std::string stored = std::move(value);
+            return decodeValue(stored[0], stored.data() + headerLen, vlen, value);
+        }
+        value.erase(0, headerLen);
+        value.resize(vlen);
+        return true;
+    }
 
-        // 拷贝 value 到 data
-        std::memcpy(data.data() + sizeof(key) + sizeof(vlen), value.data(), vlen);
+    /* 将内存中的KV储存到vLog，然后返回对应的一系列KOVpari，之后就可以生成SSTable保存在Level0
+     * 长度小于inlineThreshold的value不写入vLog，而是追加到inlineValues中，由SSTable直接保存
+     * 直接遍历跳表的最底层，value不经过拷贝，和header一起通过pwritev写入
+     */
+    void put(const MemTable &memTable, std::vector<SSTable::KOVPari> &kovPairs,
+             uint32_t inlineThreshold, std::string &inlineValues)
+    {
+        putEntries(memTable.size(), [&](const auto &visit)
+                   { memTable.forEach(visit); },
+                   kovPairs, inlineThreshold, inlineValues);
+    }
+
+    // 按顺序写入entrys，gc搬运有效数据时直接调用
+    void put(const std::vector<vLogEntry> &entrys, std::vector<SSTable::KOVPari> &kovPairs,
+             uint32_t inlineThreshold, std::string &inlineValues)
+    {
+        putEntries(entrys.size(), [&](const auto &visit)
+                   {
+                       for (const vLogEntry &entry : entrys)
+                       {
+                           visit(entry.Key, entry.Value.data(), entry.vlen);
+                       } },
+                   kovPairs, inlineThreshold, inlineValues);
+    }
 
-        // 计算CRC16校验和
-        return utils::crc16(data);
+    void reset()
+    {
+        head = tail = 0;
+        segments.clear();
+        unmapAll();
+        closeFile();
+        utils::rmfile(fileName);
+        utils::rmfile(superName());
     }
 };
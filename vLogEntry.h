@@ -2,28 +2,42 @@
 #include <vector>
 #include "utils.h"
 #define MAGIC 0xff
+/* magic的最低位表示校验和的版本：1为旧的CRC16，0为CRC32C
+ * CRC16的entry：Magic(1) CheckSum(2) Key(8) vlen(4) Value \0
+ * CRC32C的entry：Magic(1) CheckSum(4) Key(8) vlen(4) Value \0
+ * 两种header中Key和vlen都是最后12字节 */
+#define MAGIC_CRC32C 0xfe
+#define ENTRYOFFSET (15)
+#define ENTRYOFFSET_CRC32C (17)
+#define MAXENTRYOFFSET ENTRYOFFSET_CRC32C
+/* magic的第1位为0表示value经过LZ压缩，此时vlen是压缩后的长度，value的前4字节是原始长度
+ * 校验和按写入文件的内容计算 */
+#define MAGIC_LZ 0x02
+#define ISMAGIC(m) ((uint8_t)((m) | 3) == MAGIC)
+#define ISCOMPRESSED(m) (!((m) & MAGIC_LZ))
+
+/* 新写入vLog的entry使用的校验和 */
+enum class ChecksumType
+{
+    CRC16,
+    CRC32C
+};
+
+/* 新写入vLog的value是否压缩 */
+enum class CompressionType
+{
+    NONE,
+    LZ
+};
 
 class vLogEntry
 {
 public:
-    uint8_t Magic = MAGIC;
-    uint16_t CheckSum;
     uint64_t Key;
     uint32_t vlen;
     std::string Value;
-    vLogEntry(uint64_t key, const std::string &value) : Key(key), Value(value), vlen(value.length())
+    vLogEntry(uint64_t key, const std::string &value) : Key(key), vlen(value.length()), Value(value)
     {
-        std::vector<unsigned char> data( 12 + vlen);
-        // 拷贝 key 到 data
-        std::memcpy(data.data(), &Key, 8);
-
-        // 拷贝 vlen 到 data
-        std::memcpy(data.data() + 8, &vlen, 4);
-
-        // 拷贝 value 到 data
-        std::memcpy(data.data() + 12, value.data(), vlen);
-
-        CheckSum = utils::crc16(data);
     }
     ~vLogEntry() = default;
 
@@ -38,4 +52,53 @@ public:
 
     // Move assignment operator
     vLogEntry &operator=(vLogEntry &&other) = default;
-};
\ No newline at end of file
+
+    static uint8_t magicOf(ChecksumType type)
+    {
+        return type == ChecksumType::CRC32C ? MAGIC_CRC32C : MAGIC;
+    }
+
+    // magic对应的header长度
+    static size_t headerSize(uint8_t magic)
+    {
+        return (magic & 1) ? ENTRYOFFSET : ENTRYOFFSET_CRC32C;
+    }
+
+    /* 解析header，返回header的长度，调用者保证header中至少有headerSize(header[0])字节 */
+    static size_t decodeHeader(const char *header, uint32_t &checkSum, uint64_t &key, uint32_t &vlen)
+    {
+        size_t size = headerSize(header[0]);
+        checkSum = 0;
+        std::memcpy(&checkSum, header + 1, size - 13);
+        std::memcpy(&key, header + size - 12, sizeof(key));
+        std::memcpy(&vlen, header + size - 4, sizeof(vlen));
+        return size;
+    }
+
+    /* 计算校验和并写入header，返回header的长度，header至少要有MAXENTRYOFFSET字节 */
+    static size_t encodeHeader(char *header, uint8_t magic, uint64_t key, uint32_t vlen, const char *value)
+    {
+        size_t size = headerSize(magic);
+        uint32_t checkSum = checksum(magic, key, vlen, value);
+        header[0] = magic;
+        std::memcpy(header + 1, &checkSum, size - 13);
+        std::memcpy(header + size - 12, &key, sizeof(key));
+        std::memcpy(header + size - 4, &vlen, sizeof(vlen));
+        return size;
+    }
+
+    /* 按magic对应的算法依次对key、vlen和value计算校验和，不需要拷贝到临时缓冲区
+     * CRC16的结果只占低16位 */
+    static uint32_t checksum(uint8_t magic, uint64_t key, uint32_t vlen, const char *value)
+    {
+        if (!(magic & 1))
+        {
+            uint32_t crc = utils::crc32c(0, &key, sizeof(key));
+            crc = utils::crc32c(crc, &vlen, sizeof(vlen));
+            return utils::crc32c(crc, value, vlen);
+        }
+        uint16_t crc = utils::crc16((const unsigned char *)&key, sizeof(key));
+        crc = utils::crc16((const unsigned char *)&vlen, sizeof(vlen), crc);
+        return utils::crc16((const unsigned char *)value, vlen, crc);
+    }
+};